@@ -0,0 +1,95 @@
+//
+// Created by kodor on 3/14/22.
+//
+
+#include "http_arena.h"
+
+#include <cstring>
+
+QT_BEGIN_NAMESPACE
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+HttpArena::HttpArena()
+: current(inlineBlock), end(inlineBlock + inlineSize) {}
+
+HttpArena::~HttpArena() {
+    reset();
+}
+
+char *HttpArena::allocate(int size) {
+    Q_ASSERT(size >= 0);
+
+    if (size > end - current) {
+        // The rest of the current block is left unused.
+        const int length = qMax(size, int(blockSize));
+        char *block = new char[size_t(length)];
+        blocks.push_back(block);
+        current = block;
+        end = block + length;
+    }
+
+    char *data = current;
+    current += size;
+    return data;
+}
+
+char *HttpArena::copy(const char *data, int size) {
+    char *target = allocate(size);
+    memcpy(target, data, size_t(size));
+    return target;
+}
+
+const char *HttpArena::decodePercent(const char *data, int *size, bool plusAsSpace) {
+    const int length = *size;
+    int i = 0;
+
+    while (i < length && data[i] != '%' && !(plusAsSpace && data[i] == '+'))
+        ++i;
+    if (i == length)
+        return data;
+
+    // Decoding never makes it longer.
+    char *decoded = allocate(length);
+    memcpy(decoded, data, size_t(i));
+    int out = i;
+
+    for (; i < length; ++i) {
+        const char c = data[i];
+        int high, low;
+
+        if (c == '%' && i + 2 < length
+                && (high = hexValue(data[i + 1])) >= 0 && (low = hexValue(data[i + 2])) >= 0) {
+            decoded[out++] = char(high << 4 | low);
+            i += 2;
+        } else if (plusAsSpace && c == '+') {
+            decoded[out++] = ' ';
+        } else {
+            decoded[out++] = c;
+        }
+    }
+
+    // Only the decoded length stays taken.
+    current -= length - out;
+    *size = out;
+    return decoded;
+}
+
+void HttpArena::reset() {
+    for (char *block : blocks)
+        delete[] block;
+    blocks.clear();
+
+    current = inlineBlock;
+    end = inlineBlock + inlineSize;
+}
+
+QT_END_NAMESPACE
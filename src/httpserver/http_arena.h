@@ -0,0 +1,50 @@
+//
+// Created by kodor on 3/14/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_ARENA_H
+#define QT_TCP_SERVER_HTTP_ARENA_H
+
+#include <QtCore/qglobal.h>
+
+#include <vector>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Bump allocator for what is derived from a request while it's handled:
+ * decoded route captures, path and query. The first kilobyte is inline,
+ * so a typical request never reaches the heap, and everything is given
+ * back at once by reset() when the message is done.
+ */
+class HttpArena {
+public:
+    HttpArena();
+    ~HttpArena();
+
+    char *allocate(int size);
+    char *copy(const char *data, int size);
+
+    // Percent-decodes [data, data + *size). Returns data itself when there
+    // is nothing to decode, a copy in the arena otherwise, and updates
+    // *size. Malformed escapes are kept as they are.
+    const char *decodePercent(const char *data, int *size, bool plusAsSpace = false);
+
+    void reset();
+
+private:
+    static const int inlineSize = 1024;
+    static const int blockSize = 16 * 1024;
+
+    char *current;
+    char *end;
+    std::vector<char *> blocks;
+    char inlineBlock[inlineSize];
+
+    Q_DISABLE_COPY(HttpArena)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_ARENA_H
@@ -0,0 +1,78 @@
+//
+// Created by kodor on 3/13/22.
+//
+
+#include "http_body_writer.h"
+#include "http_content_type.h"
+
+QT_BEGIN_NAMESPACE
+
+HttpBodyWriter::HttpBodyWriter(HttpResponder &responder, const QByteArray &contentType,
+                               HttpResponder::HeaderList headers, HttpResponder::StatusCode status)
+: responder(responder), status(status), contentType(contentType) {
+    // The list only lives as long as the call; headers go out later.
+    for (const auto &header : headers)
+        this->headers.append(qMakePair(header.first, header.second));
+
+    // Reserved, so that emptying it after a chunk keeps the allocation.
+    buffer.reserve(HttpResponder::coalesceLimit + 1024);
+}
+
+HttpBodyWriter::~HttpBodyWriter() {
+    finish();
+}
+
+void HttpBodyWriter::addHeader(const QByteArray &key, const QByteArray &value) {
+    Q_ASSERT(buffer.isEmpty() && !streaming && !finished);
+    headers.append(qMakePair(key, value));
+}
+
+void HttpBodyWriter::write(const char *data, int size) {
+    buffer.append(data, size);
+    flushIfFull();
+}
+
+void HttpBodyWriter::write(const QByteArray &data) {
+    buffer.append(data);
+    flushIfFull();
+}
+
+void HttpBodyWriter::writeHeaders() {
+    responder.writeHeader(HttpContentTypes::contentTypeHeader(), contentType);
+    for (const auto &header : headers)
+        responder.writeHeader(header.first, header.second);
+}
+
+void HttpBodyWriter::flushIfFull() {
+    if (buffer.size() < HttpResponder::coalesceLimit)
+        return;
+
+    if (!streaming) {
+        responder.beginChunks(status);
+        writeHeaders();
+        streaming = true;
+    }
+
+    responder.writeChunk(buffer);
+    buffer.resize(0);
+}
+
+void HttpBodyWriter::finish() {
+    if (finished)
+        return;
+    finished = true;
+
+    if (streaming) {
+        responder.writeChunk(buffer);
+        responder.endChunks();
+        return;
+    }
+
+    responder.writeStatusLine(status);
+    responder.writeHeader(HttpContentTypes::contentLengthHeader(), buffer.size());
+    writeHeaders();
+    responder.writeBody(buffer);
+    responder.flush();
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,59 @@
+//
+// Created by kodor on 3/13/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_BODY_WRITER_H
+#define QT_TCP_SERVER_HTTP_BODY_WRITER_H
+
+#include "http_response.h"
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qpair.h>
+#include <QtCore/qvector.h>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Collects a generated body up to the responder's coalescing size. A body
+ * that ends before that goes out in one write with a Content-Length and
+ * can be cached; a longer one continues as a chunked body, so memory stays
+ * bounded by that size however much is generated.
+ */
+class HttpBodyWriter {
+public:
+    HttpBodyWriter(HttpResponder &responder, const QByteArray &contentType,
+                   HttpResponder::HeaderList headers = {},
+                   HttpResponder::StatusCode status = HttpResponder::StatusCode::Ok);
+    virtual ~HttpBodyWriter();
+
+    // Has to come before anything is written.
+    void addHeader(const QByteArray &key, const QByteArray &value);
+
+    void write(const char *data, int size);
+    void write(const QByteArray &data);
+
+    // Sends what is left. Called by the destructor otherwise.
+    void finish();
+
+protected:
+    void flushIfFull();
+
+    QByteArray buffer;
+
+private:
+    void writeHeaders();
+
+    HttpResponder &responder;
+    const HttpResponder::StatusCode status;
+    const QByteArray contentType;
+    QVector<QPair<QByteArray, QByteArray>> headers;
+    bool streaming { false };
+    bool finished { false };
+
+    Q_DISABLE_COPY(HttpBodyWriter)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_BODY_WRITER_H
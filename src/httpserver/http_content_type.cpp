@@ -6,24 +6,84 @@
 
 QT_BEGIN_NAMESPACE
 
-QByteArray HttpContentTypes::contentTypeHeader() {
-    return QByteArrayLiteral("Content-Type");
+const QByteArray &HttpContentTypes::contentTypeHeader() {
+    static const QByteArray value = QByteArrayLiteral("Content-Type");
+    return value;
 }
 
-QByteArray HttpContentTypes::contentTypeXEmpty()  {
-    return QByteArrayLiteral("application/x-empty");
+const QByteArray &HttpContentTypes::contentTypeXEmpty() {
+    static const QByteArray value = QByteArrayLiteral("application/x-empty");
+    return value;
 }
 
-QByteArray HttpContentTypes::contentTypeTextHTML() {
-    return QByteArrayLiteral("text/html");
+const QByteArray &HttpContentTypes::contentTypeTextHTML() {
+    static const QByteArray value = QByteArrayLiteral("text/html");
+    return value;
 }
 
-QByteArray HttpContentTypes::contentTypeJson() {
-    return QByteArrayLiteral("application/json");
+const QByteArray &HttpContentTypes::contentTypeJson() {
+    static const QByteArray value = QByteArrayLiteral("application/json");
+    return value;
 }
 
-QByteArray HttpContentTypes::contentLengthHeader() {
-    return QByteArrayLiteral("Content-Length");
+const QByteArray &HttpContentTypes::contentLengthHeader() {
+    static const QByteArray value = QByteArrayLiteral("Content-Length");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::dateHeader() {
+    static const QByteArray value = QByteArrayLiteral("Date");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::etagHeader() {
+    static const QByteArray value = QByteArrayLiteral("ETag");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::lastModifiedHeader() {
+    static const QByteArray value = QByteArrayLiteral("Last-Modified");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::acceptRangesHeader() {
+    static const QByteArray value = QByteArrayLiteral("Accept-Ranges");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::contentRangeHeader() {
+    static const QByteArray value = QByteArrayLiteral("Content-Range");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::acceptRangesBytes() {
+    static const QByteArray value = QByteArrayLiteral("bytes");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::transferEncodingHeader() {
+    static const QByteArray value = QByteArrayLiteral("Transfer-Encoding");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::transferEncodingChunked() {
+    static const QByteArray value = QByteArrayLiteral("chunked");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::connectionHeader() {
+    static const QByteArray value = QByteArrayLiteral("Connection");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::connectionClose() {
+    static const QByteArray value = QByteArrayLiteral("close");
+    return value;
+}
+
+const QByteArray &HttpContentTypes::connectionKeepAlive() {
+    static const QByteArray value = QByteArrayLiteral("keep-alive");
+    return value;
 }
 
 QT_END_NAMESPACE
\ No newline at end of file
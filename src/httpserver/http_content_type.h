@@ -9,13 +9,28 @@
 
 QT_BEGIN_NAMESPACE
 
+/*
+ * Header names and values used on every response. Each is a static
+ * QByteArray over literal data, so handing one out never allocates.
+ */
 class HttpContentTypes {
 public:
-    static QByteArray contentTypeHeader();
-    static QByteArray contentTypeXEmpty();
-    static QByteArray contentTypeTextHTML();
-    static QByteArray contentTypeJson();
-    static QByteArray contentLengthHeader();
+    static const QByteArray &contentTypeHeader();
+    static const QByteArray &contentTypeXEmpty();
+    static const QByteArray &contentTypeTextHTML();
+    static const QByteArray &contentTypeJson();
+    static const QByteArray &contentLengthHeader();
+    static const QByteArray &dateHeader();
+    static const QByteArray &etagHeader();
+    static const QByteArray &lastModifiedHeader();
+    static const QByteArray &acceptRangesHeader();
+    static const QByteArray &contentRangeHeader();
+    static const QByteArray &acceptRangesBytes();
+    static const QByteArray &transferEncodingHeader();
+    static const QByteArray &transferEncodingChunked();
+    static const QByteArray &connectionHeader();
+    static const QByteArray &connectionClose();
+    static const QByteArray &connectionKeepAlive();
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,106 @@
+//
+// Created by kodor on 2/27/22.
+//
+
+#include "http_file_transfer.h"
+
+#include <QtCore/qfile.h>
+#include <QtCore/qloggingcategory.h>
+#include <QtCore/qsocketnotifier.h>
+#include <QtNetwork/qtcpsocket.h>
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(Q_OS_LINUX)
+#include <sys/sendfile.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+Q_LOGGING_CATEGORY(lcFileTransfer, "httpserver.filetransfer")
+
+// sendfile() moves at most this much per call on Linux.
+static const qint64 maxSendfileChunk = 0x7ffff000;
+
+HttpFileTransfer::HttpFileTransfer(QFile *file, qint64 offset, qint64 length, QTcpSocket *socket)
+: QObject(socket), file(file), socket(socket), offset(offset), remaining(length) {
+    file->setParent(this);
+}
+
+HttpFileTransfer::~HttpFileTransfer() {
+    QObject::disconnect(bytesWrittenConnection);
+}
+
+void HttpFileTransfer::start() {
+    // Whatever Qt still buffers for the socket (our headers) has to go out
+    // before we write around it.
+    socket->flush();
+
+    if (socket->bytesToWrite() == 0) {
+        send();
+        return;
+    }
+
+    bytesWrittenConnection = QObject::connect(socket, &QIODevice::bytesWritten, this, [this] () {
+        if (socket->bytesToWrite() > 0)
+            return;
+
+        QObject::disconnect(bytesWrittenConnection);
+        send();
+    });
+}
+
+void HttpFileTransfer::send() {
+#if defined(Q_OS_LINUX)
+    const int socketDescriptor = int(socket->socketDescriptor());
+    const int fileDescriptor = file->handle();
+
+    while (remaining > 0) {
+        off_t position = off_t(offset);
+        const ssize_t sent = ::sendfile(socketDescriptor, fileDescriptor, &position,
+                                        size_t(qMin(remaining, maxSendfileChunk)));
+
+        if (sent > 0) {
+            offset += sent;
+            remaining -= sent;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!notifier) {
+                notifier = new QSocketNotifier(socketDescriptor, QSocketNotifier::Write, this);
+                // String-based: activated() is overloaded differently
+                // across Qt 5 releases.
+                QObject::connect(notifier, SIGNAL(activated(int)), this, SLOT(send()));
+            }
+            notifier->setEnabled(true);
+            return;
+        } else {
+            fail(sent < 0 ? strerror(errno) : "file shrank while sending");
+            return;
+        }
+    }
+
+    if (notifier)
+        notifier->setEnabled(false);
+
+    Q_EMIT finished();
+    deleteLater();
+#else
+    fail("sendfile is not available");
+#endif
+}
+
+void HttpFileTransfer::fail(const char *what) {
+    qCWarning(lcFileTransfer, "Error sending %s: %s", qPrintable(file->fileName()), what);
+
+    if (notifier)
+        notifier->setEnabled(false);
+
+    // The response is cut short; the client can only tell by the connection
+    // going away.
+    socket->abort();
+    deleteLater();
+}
+
+QT_END_NAMESPACE
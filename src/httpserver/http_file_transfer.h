@@ -0,0 +1,53 @@
+//
+// Created by kodor on 2/27/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_FILE_TRANSFER_H
+#define QT_TCP_SERVER_HTTP_FILE_TRANSFER_H
+
+#include <QtCore/qobject.h>
+#include <QtCore/qmetaobject.h>
+
+QT_BEGIN_NAMESPACE
+
+class QFile;
+class QSocketNotifier;
+class QTcpSocket;
+
+/*
+ * Copies a byte range of a file to a socket with sendfile(2), so the data
+ * goes from the page cache to the socket without passing through user
+ * space. Waits for the socket's own write buffer to drain first, then
+ * writes whenever the socket is writable. Linux only.
+ */
+class HttpFileTransfer : public QObject {
+    Q_OBJECT
+
+public:
+    HttpFileTransfer(QFile *file, qint64 offset, qint64 length, QTcpSocket *socket);
+    ~HttpFileTransfer();
+
+    void start();
+
+Q_SIGNALS:
+    void finished();
+
+private Q_SLOTS:
+    void send();
+
+private:
+    void fail(const char *what);
+
+    QFile *const file;
+    QTcpSocket *const socket;
+    QSocketNotifier *notifier { nullptr };
+    QMetaObject::Connection bytesWrittenConnection;
+
+    qint64 offset;
+    qint64 remaining;
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_FILE_TRANSFER_H
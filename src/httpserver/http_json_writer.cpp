@@ -0,0 +1,185 @@
+//
+// Created by kodor on 3/12/22.
+//
+
+#include "http_json_writer.h"
+#include "http_content_type.h"
+
+#include <QtCore/qlocale.h>
+
+#include <cmath>
+
+QT_BEGIN_NAMESPACE
+
+HttpJsonWriter::HttpJsonWriter(HttpResponder &responder, HttpResponder::HeaderList headers,
+                               HttpResponder::StatusCode status)
+: HttpBodyWriter(responder, HttpContentTypes::contentTypeJson(), std::move(headers), status) {}
+
+void HttpJsonWriter::separate() {
+    if (afterKey) {
+        afterKey = false;
+        return;
+    }
+
+    if (!hasMembers.isEmpty()) {
+        if (hasMembers.last())
+            buffer.append(',');
+        hasMembers.last() = true;
+    }
+}
+
+void HttpJsonWriter::open(char bracket) {
+    separate();
+    buffer.append(bracket);
+    hasMembers.append(false);
+}
+
+void HttpJsonWriter::close(char bracket) {
+    Q_ASSERT(!hasMembers.isEmpty());
+    hasMembers.removeLast();
+    buffer.append(bracket);
+    flushIfFull();
+}
+
+void HttpJsonWriter::beginObject() {
+    open('{');
+}
+
+void HttpJsonWriter::endObject() {
+    close('}');
+}
+
+void HttpJsonWriter::beginArray() {
+    open('[');
+}
+
+void HttpJsonWriter::endArray() {
+    close(']');
+}
+
+void HttpJsonWriter::key(const char *name) {
+    separate();
+    appendString(name, int(qstrlen(name)));
+    buffer.append(':');
+    afterKey = true;
+}
+
+void HttpJsonWriter::key(const QString &name) {
+    separate();
+    const QByteArray utf8 = name.toUtf8();
+    appendString(utf8.constData(), utf8.size());
+    buffer.append(':');
+    afterKey = true;
+}
+
+void HttpJsonWriter::value(bool value) {
+    separate();
+    if (value)
+        buffer.append("true", 4);
+    else
+        buffer.append("false", 5);
+    flushIfFull();
+}
+
+void HttpJsonWriter::value(int value) {
+    this->value(qint64(value));
+}
+
+void HttpJsonWriter::value(qint64 value) {
+    separate();
+    if (value < 0) {
+        buffer.append('-');
+        appendNumber(quint64(0) - quint64(value));
+    } else {
+        appendNumber(quint64(value));
+    }
+    flushIfFull();
+}
+
+void HttpJsonWriter::value(quint64 value) {
+    separate();
+    appendNumber(value);
+    flushIfFull();
+}
+
+void HttpJsonWriter::value(double value) {
+    // JSON has no infinities or NaN.
+    if (!std::isfinite(value)) {
+        nullValue();
+        return;
+    }
+
+    separate();
+    buffer.append(QByteArray::number(value, 'g', QLocale::FloatingPointShortest));
+    flushIfFull();
+}
+
+void HttpJsonWriter::value(const char *value) {
+    separate();
+    appendString(value, int(qstrlen(value)));
+    flushIfFull();
+}
+
+void HttpJsonWriter::value(const QByteArray &value) {
+    separate();
+    appendString(value.constData(), value.size());
+    flushIfFull();
+}
+
+void HttpJsonWriter::value(const QString &value) {
+    this->value(value.toUtf8());
+}
+
+void HttpJsonWriter::nullValue() {
+    separate();
+    buffer.append("null", 4);
+    flushIfFull();
+}
+
+void HttpJsonWriter::appendNumber(quint64 value) {
+    char digits[20];
+    int length = 0;
+
+    do {
+        digits[sizeof(digits) - 1 - length++] = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    buffer.append(digits + sizeof(digits) - length, length);
+}
+
+void HttpJsonWriter::appendString(const char *data, int size) {
+    buffer.append('"');
+
+    // Runs that need no escaping are copied in one go.
+    int start = 0;
+
+    for (int i = 0; i < size; ++i) {
+        const uchar c = uchar(data[i]);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        buffer.append(data + start, i - start);
+        start = i + 1;
+
+        switch (c) {
+            case '"':  buffer.append("\\\"", 2); break;
+            case '\\': buffer.append("\\\\", 2); break;
+            case '\n': buffer.append("\\n", 2); break;
+            case '\r': buffer.append("\\r", 2); break;
+            case '\t': buffer.append("\\t", 2); break;
+            case '\b': buffer.append("\\b", 2); break;
+            case '\f': buffer.append("\\f", 2); break;
+            default: {
+                const char escape[] = { '\\', 'u', '0', '0',
+                                        "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 0xf] };
+                buffer.append(escape, int(sizeof(escape)));
+            }
+        }
+    }
+
+    buffer.append(data + start, size - start);
+    buffer.append('"');
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,60 @@
+//
+// Created by kodor on 3/12/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_JSON_WRITER_H
+#define QT_TCP_SERVER_HTTP_JSON_WRITER_H
+
+#include "http_body_writer.h"
+
+#include <QtCore/qstring.h>
+#include <QtCore/qvarlengtharray.h>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Serialises JSON token by token straight into a response, without a
+ * QJsonDocument in between.
+ */
+class HttpJsonWriter : public HttpBodyWriter {
+public:
+    explicit HttpJsonWriter(HttpResponder &responder,
+                            HttpResponder::HeaderList headers = {},
+                            HttpResponder::StatusCode status = HttpResponder::StatusCode::Ok);
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    // Name of the next value inside an object.
+    void key(const char *name);
+    void key(const QString &name);
+
+    void value(bool value);
+    void value(int value);
+    void value(qint64 value);
+    void value(quint64 value);
+    void value(double value);
+    // Strings; a QByteArray has to hold UTF-8.
+    void value(const char *value);
+    void value(const QByteArray &value);
+    void value(const QString &value);
+    void nullValue();
+
+private:
+    void separate();
+    void open(char bracket);
+    void close(char bracket);
+    void appendString(const char *data, int size);
+    void appendNumber(quint64 value);
+
+    // Per open object or array: whether it has a member yet.
+    QVarLengthArray<bool, 16> hasMembers;
+    bool afterKey { false };
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_JSON_WRITER_H
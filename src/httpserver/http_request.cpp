@@ -3,9 +3,12 @@
 //
 
 #include "http_request.h"
+#include "http_request_body.h"
+#include "http_scanner.h"
 
-#include <array>
-#include <string>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 
 
 
@@ -13,64 +16,229 @@ QT_BEGIN_NAMESPACE
 
 Q_LOGGING_CATEGORY(lc, "httpserver.request")
 
+// Upper bound for what a client can make us allocate up front by
+// announcing a large body; beyond it buffers grow as data really arrives.
+static const size_t maxBodyReservation = 16 * 1024 * 1024;
+
+// Spans index the receive buffer with int. A message that would make it
+// grow past this is refused, long before the arithmetic could overflow.
+static const int maxReceiveBuffer = INT_MAX / 2;
+
+// Receive buffer a recycled request starts with. One that grew past
+// maxPooledBuffer for a large body is given back instead of being kept.
+static const int pooledBuffer = 4 * 1024;
+static const int maxPooledBuffer = 64 * 1024;
+// Idle requests kept per thread.
+static const int maxPooledRequests = 1024;
+
+namespace {
+
+struct RequestPool {
+    ~RequestPool() {
+        qDeleteAll(idle);
+    }
+
+    QVector<HttpRequest *> idle;
+};
+
+}
+
+static thread_local RequestPool requestPool;
+
+static const struct {
+    const char *name;
+    int length;
+} knownHeaderNames[] = {
+    { "Host", 4 },
+    { "Content-Length", 14 },
+    { "Content-Type", 12 },
+    { "Transfer-Encoding", 17 },
+    { "Connection", 10 },
+    { "Upgrade", 7 },
+    { "Accept", 6 },
+    { "Accept-Encoding", 15 },
+    { "If-None-Match", 13 },
+    { "If-Modified-Since", 17 },
+    { "Range", 5 },
+    { "If-Range", 8 },
+};
+
+static HttpRequest::Method methodFromToken(const char *token, int length) {
+    using Method = HttpRequest::Method;
+
+    switch (length) {
+        case 3:
+            if (memcmp(token, "GET", 3) == 0)
+                return Method::Get;
+            if (memcmp(token, "PUT", 3) == 0)
+                return Method::Put;
+            break;
+        case 4:
+            if (memcmp(token, "POST", 4) == 0)
+                return Method::Post;
+            if (memcmp(token, "HEAD", 4) == 0)
+                return Method::Head;
+            break;
+        case 5:
+            if (memcmp(token, "PATCH", 5) == 0)
+                return Method::Patch;
+            break;
+        case 6:
+            if (memcmp(token, "DELETE", 6) == 0)
+                return Method::Delete;
+            break;
+        case 7:
+            if (memcmp(token, "OPTIONS", 7) == 0)
+                return Method::Options;
+            break;
+    }
+
+    return Method::Unknown;
+}
+
 HttpRequest::HttpRequest(const QHostAddress &remoteAddress)
-: _remoteAddress(remoteAddress) {}
+: _remoteAddress(remoteAddress) {
+    _buffer.reserve(pooledBuffer);
+    clearHeaders();
+}
+
+HttpRequest *HttpRequest::acquire(const QHostAddress &remoteAddress) {
+    auto &idle = requestPool.idle;
+    if (idle.isEmpty())
+        return new HttpRequest(remoteAddress);
+
+    auto request = idle.takeLast();
+    request->reset(remoteAddress);
+    return request;
+}
+
+void HttpRequest::release(HttpRequest *request) {
+    // A body stream is a child of the socket and goes away with it.
+    request->_bodyStream = nullptr;
+
+    auto &idle = requestPool.idle;
+    if (idle.size() >= maxPooledRequests) {
+        delete request;
+        return;
+    }
+
+    idle.append(request);
+}
 
 QByteArray HttpRequest::header(const QByteArray &key) const {
-    return _headers.value(headerHash(key)).second;
+    return value(key);
 }
 
 QByteArray HttpRequest::value(const QByteArray &key) const {
-    return _headers.value(headerHash(key)).second;
+    const auto field = findHeader(key.constData(), key.size());
+    if (!field)
+        return QByteArray();
+
+    QByteArray value = bytes(field->value);
+    const char *data = _buffer.constData();
+
+    for (auto next = field + 1; next != _headers.constEnd(); ++next) {
+        if (equalsNoCase(data + next->name.offset, next->name.length, key.constData(), key.size())) {
+            value.append(", ", 2);
+            value.append(data + next->value.offset, next->value.length);
+        }
+    }
+
+    return value;
+}
+
+QVector<QByteArray> HttpRequest::values(const QByteArray &key) const {
+    QVector<QByteArray> values;
+    const char *data = _buffer.constData();
+
+    for (const auto &field : _headers) {
+        if (equalsNoCase(data + field.name.offset, field.name.length, key.constData(), key.size()))
+            values.append(bytes(field.value));
+    }
+
+    return values;
 }
 
 HttpRequest::~HttpRequest() {}
 
 bool HttpRequest::parse(QIODevice *socket) {
-    const auto fragment = socket->readAll();
-
-    if (fragment.size()) {
-        _url.setScheme(QStringLiteral("http"));
+    auto available = socket->bytesAvailable();
+
+    // Leave what the handler can't take yet in the socket; its bounded read
+    // buffer then pushes back on the client.
+    if (_bodyStream)
+        available = qMin(available, _bodyStream->freeSpace());
+
+    if (available > 0) {
+        const int offset = _buffer.size();
+        if (available > maxReceiveBuffer - offset) {
+            parserState.error = ParseError::BodyTooLarge;
+            qCDebug(lc) << "oversized request from" << _remoteAddress;
+            return false;
+        }
 
-        const auto parsed = parse(fragment);
+        // Read straight into the receive buffer instead of going through a
+        // temporary from readAll().
+        _buffer.resize(offset + int(available));
+        const auto read = socket->read(_buffer.data() + offset, available);
+        _buffer.resize(offset + int(qMax<qint64>(read, 0)));
+    }
 
-        qCDebug(lc) << url();
+    // Parse even when nothing new was read: the buffer may still hold
+    // messages the client pipelined behind the previous one.
+    if (parse() == ParseResult::Error) {
+        qCDebug(lc) << "malformed request from" << _remoteAddress;
+        return false;
     }
 
+    if (_bodyStream)
+        drainBody();
+
     return true;
 }
 
-// TODO: USE QT type for string, char and other
+HttpRequest::ParseResult HttpRequest::parse() {
+    if (state == State::MessageComplete)
+        return ParseResult::Complete;
 
-size_t HttpRequest::parse(const QByteArray &fragment) {
+    // Non-const access is only needed to unfold obsolete header line folding
+    // in place; the buffer is never shared while parsing.
+    char *data = _buffer.data();
+    const int size = _buffer.size();
+    int &pos = parserState.position;
 
-    for (auto &&it : fragment) {
-        char input = it;
+    while (pos < size) {
+        const char input = data[pos++];
 
         switch (state) {
             case State::RequestMethodStart:
-                if (!isChar(input) || isControl(input) || isSpecial(input) ) {
-                    return -1;
+                // RFC 7230 3.5: ignore empty lines before the request line.
+                if (input == '\r' || input == '\n') {
+                    break;
+                } else if (!isToken(input)) {
+                    return ParseResult::Error;
                 } else {
                     state = State::RequestMethod;
-                    parserState.method.push_back(input);
+                    parserState.method = Span(pos - 1, 1);
                 }
                 break;
             case State::RequestMethod:
                 if (input == ' ') {
                     state = State::RequestUrlStart;
-                } else if (!isChar(input) || isControl(input) || isSpecial(input)) {
-                    return -1;
+                    parserState.methodId = methodFromToken(data + parserState.method.offset,
+                                                           parserState.method.length);
+                } else if (!isToken(input)) {
+                    return ParseResult::Error;
                 } else {
-                    parserState.method.push_back(input);
+                    pos = skip(HttpScanner::findTokenEnd, pos, size, &parserState.method);
                 }
                 break;
             case State::RequestUrlStart:
                 if (isControl(input)) {
-                    return -1;
+                    return ParseResult::Error;
                 } else {
                     state = State::RequestUrl;
-                    parserState.url.push_back(input);
+                    parserState.url = Span(pos - 1, 1);
                 }
                 break;
             case State::RequestUrl:
@@ -79,40 +247,42 @@ size_t HttpRequest::parse(const QByteArray &fragment) {
                 } else if (input == '\r') {
                     parserState.http_major = 0;
                     parserState.http_minor = 9;
+                    parserState.body = Span(pos, 0);
 
-                    return 0;
+                    state = State::MessageComplete;
+                    return ParseResult::Complete;
                 } else if (isControl(input)) {
-                    return -1;
+                    return ParseResult::Error;
                 } else {
-                    parserState.url.push_back(input);
+                    pos = skip(HttpScanner::findRequestTargetEnd, pos, size, &parserState.url);
                 }
                 break;
             case State::RequestHttpVersion_h:
                 if (input == 'H') {
                     state = State::RequestHttpVersion_ht;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_ht:
                 if (input == 'T') {
                     state = State::RequestHttpVersion_htt;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_htt:
                 if (input == 'T') {
                     state = State::RequestHttpVersion_http;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_http:
                 if (input == 'P') {
                     state = State::RequestHttpVersion_slash;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_slash:
@@ -121,7 +291,7 @@ size_t HttpRequest::parse(const QByteArray &fragment) {
                     parserState.http_major = 0;
                     state = State::RequestHttpVersion_majorStart;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_majorStart:
@@ -129,7 +299,7 @@ size_t HttpRequest::parse(const QByteArray &fragment) {
                     parserState.http_major = input - '0';
                     state = State::RequestHttpVersion_major;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_major:
@@ -138,7 +308,7 @@ size_t HttpRequest::parse(const QByteArray &fragment) {
                 } else if (isDigit(input)) {
                     parserState.http_major = parserState.http_major * 10 + input - '0';
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_minorStart:
@@ -146,7 +316,7 @@ size_t HttpRequest::parse(const QByteArray &fragment) {
                     parserState.http_minor = input - '0';
                     state = State::RequestHttpVersion_minor;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::RequestHttpVersion_minor:
@@ -155,261 +325,686 @@ size_t HttpRequest::parse(const QByteArray &fragment) {
                 } else if (isDigit(input)) {
                     parserState.http_minor = parserState.http_minor * 10 + input - '0';
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::ResponseHttpVersion_newline:
                 if (input == '\n') {
                     state = State::HeaderLineStart;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::HeaderLineStart:
                 if (input == '\r') {
                     state = State::ExpectingNewline_3;
                 } else if ( !_headers.empty() && (input == ' ' || input == '\t')) {
+                    // obs-fold: replace the preceding CRLF with spaces so the
+                    // previous value stays one contiguous span, and reopen it.
+                    data[pos - 3] = ' ';
+                    data[pos - 2] = ' ';
+                    parserState.currentHeaderName = _headers.last().name;
+                    parserState.currentHeaderValue = _headers.last().value;
+                    for (auto &index : knownHeaders) {
+                        if (index == _headers.size() - 1)
+                            index = -1;
+                    }
+                    _headers.removeLast();
                     state = State::HeaderLws;
-                } else if (!isChar(input) || isControl(input) || isSpecial(input)) {
-                    return -1;
+                } else if (!isToken(input)) {
+                    return ParseResult::Error;
                 } else {
-                    if (!parserState.currentHeaderName.isEmpty()) {
-                        const auto key = QByteArray(parserState.currentHeaderName.toStdString().c_str(),
-                                                    parserState.currentHeaderName.size());
-                        const auto value = QByteArray(parserState.currentHeaderValue.toStdString().c_str(),
-                                                      parserState.currentHeaderValue.size());
-                        _headers[headerHash(key)] =
-                                qMakePair(key, value);
-                        parserState.currentHeaderName.clear();
-                        parserState.currentHeaderValue.clear();
-                    }
-                    parserState.currentHeaderName.push_back(input);
+                    parserState.currentHeaderName = Span(pos - 1, 1);
                     state = State::HeaderName;
                 }
                 break;
             case State::HeaderLws:
                 if (input == '\r') {
+                    if (!commitHeader(pos - 1))
+                        return ParseResult::Error;
                     state = State::ExpectingNewline_2;
                 } else if (input == ' ' || input == '\t') {
 
                 } else if (isControl(input)) {
-                    return -1;
+                    return ParseResult::Error;
                 } else {
                     state = State::HeaderValue;
-                    parserState.currentHeaderValue.push_back(input);
                 }
                 break;
             case State::HeaderName:
                 if (input == ':') {
                     state = State::SpaceBeforeHeaderValue;
-                } else if (!isChar(input) || isControl(input) || isSpecial(input)) {
-                    return -1;
+                } else if (!isToken(input)) {
+                    return ParseResult::Error;
                 } else {
-                    parserState.currentHeaderName.push_back(input);
+                    pos = skip(HttpScanner::findTokenEnd, pos, size, &parserState.currentHeaderName);
                 }
                 break;
             case State::SpaceBeforeHeaderValue:
-                if (input == ' ') {
-                    state = State::HeaderValue;
+                if (input == ' ' || input == '\t') {
+
+                } else if (input == '\r') {
+                    parserState.currentHeaderValue = Span(pos - 1, 0);
+                    if (!commitHeader(pos - 1))
+                        return ParseResult::Error;
+                    state = State::ExpectingNewline_2;
+                } else if (isControl(input)) {
+                    return ParseResult::Error;
                 } else {
-                    return -1;
+                    parserState.currentHeaderValue = Span(pos - 1, 0);
+                    state = State::HeaderValue;
                 }
                 break;
             case State::HeaderValue:
                 if (input == '\r') {
-                    if (parserState.method == "POST" ||
-                        parserState.method == "PUT" ||
-                        parserState.method == "DELETE") {
-                        if (strcasecmp(parserState.currentHeaderName.toStdString().c_str(), "Content-Length") == 0) {
-                            parserState.contentSize = std::atoi(parserState.currentHeaderValue.toStdString().c_str());
-                        } else if (strcasecmp(parserState.currentHeaderName.toStdString().c_str(), "Transfer-Encoding") == 0) {
-                            if (strcasecmp(parserState.currentHeaderValue.toStdString().c_str(), "chunked") == 0)
-                                parserState.chunked = true;
-                        }
-                    }
+                    if (!commitHeader(pos - 1))
+                        return ParseResult::Error;
                     state = State::ExpectingNewline_2;
                 } else if (isControl(input)) {
-                    return -1;
+                    return ParseResult::Error;
                 } else {
-                    parserState.currentHeaderValue.push_back(input);
+                    pos = skip(HttpScanner::findFieldValueEnd, pos, size, nullptr);
                 }
                 break;
             case State::ExpectingNewline_2:
                 if (input == '\n') {
                     state = State::HeaderLineStart;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::ExpectingNewline_3: {
-                // iterate over headers and find connection
+                if (input != '\n')
+                    return ParseResult::Error;
 
-                auto it = _headers.find(headerHash("Connection"));
+                commitConnectionOptions();
 
-                if (it != _headers.end()) {
-                    parserState.keepAlive =
-                            strcasecmp(
-                                    it.value().second,
-                                    "Keep-Alive") == 0;
-                } else {
-                    if (parserState.http_major > 1 ||
-                        (parserState.http_major == 1 && parserState.http_minor == 1))
-                        parserState.keepAlive = true;
-                }
+                parserState.body = Span(pos, 0);
 
                 if (parserState.chunked) {
+                    parserState.chunkSize = 0;
                     state = State::ChunkSize;
                 } else if (parserState.contentSize == 0) {
-                    if (input == '\n')
-                        return 0;
-                    else
-                        return -1;
+                    state = State::MessageComplete;
+                    return ParseResult::Complete;
                 } else {
+                    // The body stays where it was received. Make room for it
+                    // now instead of growing the buffer read by read.
+                    _buffer.reserve(pos + int(qMin(parserState.contentSize, maxBodyReservation)));
+                    data = _buffer.data();
                     state = State::Post;
                 }
                 break;
             }
-            case State::Post:
-                --parserState.contentSize;
-                parserState.content.push_back(input);
-
-                if (parserState.contentSize == 0)
-                    return 0;
+            case State::Post: {
+                // Take everything of the body that has arrived in one step.
+                const int run = int(qMin(parserState.contentSize, size_t(size - pos + 1)));
+                parserState.body.length += run;
+                parserState.contentSize -= size_t(run);
+                pos += run - 1;
+
+                if (parserState.contentSize == 0) {
+                    state = State::MessageComplete;
+                    return ParseResult::Complete;
+                }
                 break;
-            case State::ChunkSize:
-                if (isalnum(input))
-                    parserState.chunkSizeStr.push_back(input);
-                else if (input == ';')
+            }
+            case State::ChunkSize: {
+                int digit = -1;
+                if (isDigit(input))
+                    digit = input - '0';
+                else if (toLowerAscii(input) >= 'a' && toLowerAscii(input) <= 'f')
+                    digit = toLowerAscii(input) - 'a' + 10;
+
+                if (digit >= 0) {
+                    if (parserState.chunkSize > size_t(maxReceiveBuffer) / 16) {
+                        parserState.error = ParseError::BodyTooLarge;
+                        return ParseResult::Error;
+                    }
+                    parserState.chunkSize = parserState.chunkSize * 16 + size_t(digit);
+                } else if (input == ';') {
                     state = State::ChunkExtensionName;
-                else if (input == '\r')
+                } else if (input == '\r') {
                     state = State::ChunkSizeNewLine;
-                else
-                    return -1;
+                } else {
+                    return ParseResult::Error;
+                }
                 break;
+            }
             case State::ChunkExtensionName:
                 if (input == '=')
                     state = State::ChunkExtensionValue;
                 else if (input == '\r')
                     state = State::ChunkSizeNewLine;
-                else
-                    return -1;
+                else if (isControl(input))
+                    return ParseResult::Error;
                 break;
             case State::ChunkExtensionValue:
                 if (input == '\r')
                     state = State::ChunkSizeNewLine;
-                else
-                    return -1;
+                else if (isControl(input))
+                    return ParseResult::Error;
                 break;
             case State::ChunkSizeNewLine:
                 if (input == '\n') {
-                    parserState.chunkSize = std::strtol(parserState.chunkSizeStr.toStdString().data(), NULL, 16);
-                    parserState.chunkSizeStr.clear();
-                    parserState.content.reserve(parserState.content.size() + parserState.chunkSize);
+                    if (parserState.chunkSize > size_t(maxReceiveBuffer - parserState.content.size())) {
+                        parserState.error = ParseError::BodyTooLarge;
+                        return ParseResult::Error;
+                    }
+
+                    parserState.content.reserve(parserState.content.size() +
+                            int(qMin(parserState.chunkSize, maxBodyReservation)));
 
                     if (parserState.chunkSize == 0)
                         state = State::ChunkSizeNewLine_2;
                     else
                         state = State::ChunkData;
                 } else {
-                    return -1;
+                    return ParseResult::Error;
                 }
                 break;
             case State::ChunkSizeNewLine_2:
                 if (input == '\r')
                     state = State::ChunkSizeNewLine_3;
-                else if (isalpha(input))
+                else if (isToken(input))
                     state = State::ChunkTrailerName;
                 else
-                    return -1;
+                    return ParseResult::Error;
                 break;
             case State::ChunkSizeNewLine_3:
-                if (input == '\n')
-                    return 0;
-                else
-                    return -1;
+                if (input == '\n') {
+                    state = State::MessageComplete;
+                    return ParseResult::Complete;
+                } else {
+                    return ParseResult::Error;
+                }
                 break;
             case State::ChunkTrailerName:
                 if (input == ':')
                     state = State::ChunkTrailerValue;
-                else
-                    return -1;
+                else if (!isToken(input))
+                    return ParseResult::Error;
                 break;
             case State::ChunkTrailerValue:
                 if (input == '\r')
                     state = State::ChunkSizeNewLine;
-                else
-                    return -1;
+                else if (isControl(input) && input != '\t')
+                    return ParseResult::Error;
                 break;
-            case State::ChunkData:
-                parserState.content.push_back(input);
+            case State::ChunkData: {
+                const int run = int(qMin(parserState.chunkSize, size_t(size - pos + 1)));
+                parserState.content.append(data + pos - 1, run);
+                parserState.chunkSize -= size_t(run);
+                pos += run - 1;
 
-                if (--parserState.chunkSize == 0)
+                if (parserState.chunkSize == 0)
                     state = State::ChunkDataNewLine_1;
                 break;
+            }
             case State::ChunkDataNewLine_1:
                 if (input == '\r')
                     state = State::ChunkDataNewLine_2;
                 else
-                    return -1;
+                    return ParseResult::Error;
                 break;
             case State::ChunkDataNewLine_2:
                 if (input == '\n')
                     state = State::ChunkSize;
                 else
-                    return -1;
+                    return ParseResult::Error;
                 break;
             default:
-                return -1;
+                return ParseResult::Error;
         }
 
     }
 
-    return -2;
+    return ParseResult::Incomplete;
 }
 
-uint HttpRequest::headerHash(const QByteArray &key) const {
-    return qHash(key.toLower(), headersSeed);
-}
+int HttpRequest::skip(const char *(*scan)(const char *, const char *),
+                      int pos, int size, Span *span) const {
+    // The byte before pos has been accepted already; let the scanner find
+    // where the rest of the run ends instead of going round the loop.
+    const char *data = _buffer.constData();
+    const int end = int(scan(data + pos, data + size) - data);
 
-void HttpRequest::clear() {
-    _url.clear();
-    lastHeader.clear();
-    _headers.clear();
-    _body.clear();
+    if (span)
+        span->length += end - pos + 1;
+
+    return end;
 }
 
-bool HttpRequest::parseUrl(const char *at, size_t length, bool connect, QUrl *url) {
+bool HttpRequest::commitHeader(int end) {
+    auto name = parserState.currentHeaderName;
+    auto value = parserState.currentHeaderValue;
+    const char *data = _buffer.constData();
+
+    value.length = end - value.offset;
+
+    while (value.length && (data[value.offset] == ' ' || data[value.offset] == '\t')) {
+        ++value.offset;
+        --value.length;
+    }
+
+    while (value.length && (data[value.offset + value.length - 1] == ' ' ||
+                            data[value.offset + value.length - 1] == '\t'))
+        --value.length;
+
+    const int known = knownHeader(data + name.offset, name.length);
+    const bool repeated = known >= 0 && knownHeaders[known] >= 0;
+    if (known >= 0 && !repeated)
+        knownHeaders[known] = _headers.size();
+
+    _headers.append(HeaderField { name, value });
+
+    if (known == int(KnownHeader::ContentLength)) {
+        size_t contentSize = 0;
+
+        for (int i = 0; i < value.length; ++i) {
+            const char c = data[value.offset + i];
+            if (!isDigit(c))
+                return false;
+            contentSize = contentSize * 10 + size_t(c - '0');
+            if (contentSize > size_t(maxReceiveBuffer)) {
+                parserState.error = ParseError::BodyTooLarge;
+                return false;
+            }
+        }
+
+        // Lengths that disagree leave the message framing ambiguous.
+        if (repeated && contentSize != parserState.contentSize)
+            return false;
+        parserState.contentSize = contentSize;
+    } else if (known == int(KnownHeader::TransferEncoding)) {
+        if (!commitTransferCodings(value))
+            return false;
+    }
+
+    parserState.currentHeaderName = Span();
+    parserState.currentHeaderValue = Span();
     return true;
 }
 
-HttpRequest::Method HttpRequest::method() const {
-    if (parserState.method == "POST") {
-        return Method::POST;
-    } else if (parserState.method == "PUT") {
-        return Method::PUT;
-    } else if (parserState.method == "DELETE") {
-        return Method::DELETE;
-    } else if (parserState.method == "GET") {
-        return Method::GET;
+void HttpRequest::commitConnectionOptions() {
+    bool close = false;
+    bool keepAlive = false;
+    bool upgrade = false;
+
+    // A list of options, possibly spread over several fields.
+    const auto first = findHeader("Connection", 10);
+    const char *data = _buffer.constData();
+
+    for (auto field = first; field && field != _headers.constEnd(); ++field) {
+        if (field != first && !equalsNoCase(data + field->name.offset, field->name.length,
+                                            "Connection", 10))
+            continue;
+
+        int from = field->value.offset;
+        Span option;
+
+        while (nextListElement(field->value, &from, &option)) {
+            if (spanEqualsNoCase(option, "close"))
+                close = true;
+            else if (spanEqualsNoCase(option, "keep-alive"))
+                keepAlive = true;
+            else if (spanEqualsNoCase(option, "upgrade"))
+                upgrade = true;
+        }
+    }
+
+    if (close) {
+        parserState.keepAlive = false;
+    } else if (keepAlive) {
+        parserState.keepAlive = true;
     } else {
-        return Method::All;
+        parserState.keepAlive = parserState.http_major > 1 ||
+                (parserState.http_major == 1 && parserState.http_minor >= 1);
+    }
+
+    parserState.upgrade = upgrade && findHeader("Upgrade", 7);
+}
+
+bool HttpRequest::commitTransferCodings(const Span &value) {
+    // Repeated fields add to the list. Only chunked is understood, and it
+    // has to come last, or the end of the body can't be found.
+    int from = value.offset;
+    Span coding;
+    bool any = false;
+
+    while (nextListElement(value, &from, &coding)) {
+        any = true;
+
+        if (parserState.chunked)
+            return false;
+
+        if (!spanEqualsNoCase(coding, "chunked")) {
+            parserState.error = ParseError::UnsupportedTransferCoding;
+            return false;
+        }
+        parserState.chunked = true;
+    }
+
+    return any;
+}
+
+bool HttpRequest::nextListElement(const Span &list, int *from, Span *element) const {
+    const char *data = _buffer.constData();
+    const int end = list.offset + list.length;
+
+    while (*from < end) {
+        int start = *from;
+        int stop = start;
+        while (stop < end && data[stop] != ',')
+            ++stop;
+        *from = stop + 1;
+
+        while (start < stop && (data[start] == ' ' || data[start] == '\t'))
+            ++start;
+        while (stop > start && (data[stop - 1] == ' ' || data[stop - 1] == '\t'))
+            --stop;
+
+        if (stop > start) {
+            *element = Span(start, stop - start);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool HttpRequest::headersComplete() const {
+    return state > State::ExpectingNewline_3;
+}
+
+qint64 HttpRequest::bodySize() const {
+    if (parserState.chunked)
+        return qint64(parserState.content.size()) + qint64(parserState.chunkSize);
+    return qint64(parserState.body.length) + qint64(parserState.contentSize);
+}
+
+void HttpRequest::startBodyStream(QObject *parent) {
+    Q_ASSERT(!_bodyStream);
+    _bodyStream = new HttpRequestBody(parent);
+    drainBody();
+
+    // Give back what was reserved for buffering the whole body.
+    _buffer.squeeze();
+}
+
+void HttpRequest::drainBody() {
+    Q_ASSERT(_bodyStream);
+
+    if (state == State::MessageComplete && _bodyStream->isFinished())
+        return;
+
+    // Hand over what has been parsed of the body and drop it, framing
+    // included, from the receive buffer: nothing refers to it any more.
+    const auto &body = parserState.body;
+    const int consumed = parserState.position - body.offset;
+
+    if (consumed > 0) {
+        if (parserState.chunked) {
+            _bodyStream->append(parserState.content.constData(), parserState.content.size());
+            parserState.content.resize(0);
+        } else {
+            _bodyStream->append(_buffer.constData() + body.offset, body.length);
+        }
+
+        _buffer.remove(body.offset, consumed);
+        parserState.position = body.offset;
+        parserState.body.length = 0;
     }
+
+    if (state == State::MessageComplete)
+        _bodyStream->finish();
+}
+
+QByteArray HttpRequest::bytes(const Span &span) const {
+    return _buffer.mid(span.offset, span.length);
+}
+
+HttpRequest::Span HttpRequest::pathSpan() const {
+    return parseUrl().path;
+}
+
+const QString &HttpRequest::pathString() const {
+    auto &target = _target;
+    if (!target.hasPathString) {
+        const QByteArray decoded = path();
+        target.pathString = QString::fromUtf8(decoded.constData(), decoded.size());
+        target.hasPathString = true;
+    }
+    return target.pathString;
+}
+
+bool HttpRequest::spanEquals(const Span &span, const char *literal) const {
+    const int length = int(qstrlen(literal));
+    return span.length == length &&
+           memcmp(_buffer.constData() + span.offset, literal, size_t(length)) == 0;
+}
+
+bool HttpRequest::spanEqualsNoCase(const Span &span, const char *literal) const {
+    return equalsNoCase(_buffer.constData() + span.offset, span.length,
+                        literal, int(qstrlen(literal)));
+}
+
+int HttpRequest::knownHeader(const char *name, int length) {
+    for (int i = 0; i < int(KnownHeader::Count); ++i) {
+        if (knownHeaderNames[i].length == length &&
+            equalsNoCase(name, length, knownHeaderNames[i].name, knownHeaderNames[i].length))
+            return i;
+    }
+
+    return -1;
+}
+
+const HttpRequest::HeaderField *HttpRequest::findHeader(const char *name, int length) const {
+    const int known = knownHeader(name, length);
+    if (known >= 0) {
+        const int index = knownHeaders[known];
+        return index < 0 ? nullptr : &_headers[index];
+    }
+
+    const char *data = _buffer.constData();
+
+    for (const auto &field : _headers) {
+        if (equalsNoCase(data + field.name.offset, field.name.length, name, length))
+            return &field;
+    }
+
+    return nullptr;
+}
+
+void HttpRequest::clearHeaders() {
+    // The inline storage and whatever it grew into are kept.
+    _headers.clear();
+    std::fill(knownHeaders, knownHeaders + int(KnownHeader::Count), -1);
+}
+
+void HttpRequest::clear() {
+    if (_bodyStream) {
+        _bodyStream->deleteLater();
+        _bodyStream = nullptr;
+    }
+    streamingChecked = false;
+
+    // Whatever follows the message just handled was pipelined by the
+    // client and starts the next one.
+    _buffer.remove(0, parserState.position);
+    clearHeaders();
+    _arena.reset();
+    _target = Target();
+    parserState = HttpParserState();
+    state = State::RequestMethodStart;
+}
+
+void HttpRequest::reset(const QHostAddress &remoteAddress) {
+    Q_ASSERT(!_bodyStream);
+
+    // Sized back down, but otherwise the allocations of the previous
+    // connection are reused; reserve() also keeps resize(0) from freeing.
+    if (_buffer.capacity() > maxPooledBuffer)
+        _buffer = QByteArray();
+    _buffer.reserve(pooledBuffer);
+    _buffer.resize(0);
+    clearHeaders();
+    _arena.reset();
+    _target = Target();
+
+    QByteArray content;
+    content.swap(parserState.content);
+    parserState = HttpParserState();
+    if (content.capacity() <= maxPooledBuffer) {
+        content.resize(0);
+        parserState.content.swap(content);
+    }
+    state = State::RequestMethodStart;
+
+    handling = false;
+    responsePending = false;
+    handledCount = 0;
+    streamingChecked = false;
+    port = 0;
+    _remoteAddress = remoteAddress;
+}
+
+const HttpRequest::Target &HttpRequest::parseUrl() const {
+    auto &target = _target;
+    if (target.parsed)
+        return target;
+    target.parsed = true;
+
+    const char *data = _buffer.constData();
+    int begin = parserState.url.offset;
+    const int end = begin + parserState.url.length;
+
+    // absolute-form: skip scheme and authority
+    if (begin != end && data[begin] != '/') {
+        const char *scheme = static_cast<const char *>(
+                memchr(data + begin, ':', size_t(end - begin)));
+        if (!scheme || end - (scheme - data) < 3 || scheme[1] != '/' || scheme[2] != '/') {
+            // asterisk-form and authority-form have neither path nor query.
+            target.path = Span(begin, 0);
+            target.query = Span(begin, 0);
+            return target;
+        }
+
+        begin = int(scheme - data) + 3;
+        while (begin != end && data[begin] != '/')
+            ++begin;
+    }
+
+    int pos = begin;
+    while (pos != end && data[pos] != '?' && data[pos] != '#')
+        ++pos;
+    target.path = Span(begin, pos - begin);
+
+    int queryEnd = pos;
+    if (pos != end && data[pos] == '?') {
+        ++pos;
+        queryEnd = pos;
+        while (queryEnd != end && data[queryEnd] != '#')
+            ++queryEnd;
+    }
+    target.query = Span(pos, queryEnd - pos);
+
+    return target;
+}
+
+QByteArray HttpRequest::path() const {
+    auto &target = _target;
+    const Span path = parseUrl().path;
+    const char *data = _buffer.constData() + path.offset;
+
+    if (!target.pathDecoded) {
+        int size = path.length;
+        const char *decoded = _arena.decodePercent(data, &size);
+        if (decoded != data) {
+            target.decodedPath = decoded;
+            target.decodedPathSize = size;
+        }
+        target.pathDecoded = true;
+    }
+
+    if (target.decodedPath)
+        return QByteArray(target.decodedPath, target.decodedPathSize);
+    return QByteArray(data, path.length);
+}
+
+QByteArray HttpRequest::queryString() const {
+    return bytes(parseUrl().query);
+}
+
+QByteArray HttpRequest::query(const QByteArray &key) const {
+    const Span query = parseUrl().query;
+    const char *data = _buffer.constData() + query.offset;
+    int pos = 0;
+
+    while (pos < query.length) {
+        const char *item = data + pos;
+        const void *amp = memchr(item, '&', size_t(query.length - pos));
+        const int itemLength = amp ? int(static_cast<const char *>(amp) - item) : query.length - pos;
+        pos += itemLength + 1;
+
+        const void *equals = memchr(item, '=', size_t(itemLength));
+        int nameLength = equals ? int(static_cast<const char *>(equals) - item) : itemLength;
+
+        // Names are compared as decoded; the arena takes whatever decoding
+        // produces until the message is done.
+        const char *name = _arena.decodePercent(item, &nameLength, true);
+        if (nameLength != key.size() || memcmp(name, key.constData(), size_t(nameLength)) != 0)
+            continue;
+
+        if (!equals)
+            return QByteArray("");
+
+        const char *value = static_cast<const char *>(equals) + 1;
+        int valueLength = int(item + itemLength - value);
+        value = _arena.decodePercent(value, &valueLength, true);
+        return QByteArray(value, valueLength);
+    }
+
+    return QByteArray();
+}
+
+bool HttpRequest::isKeepAlive() const {
+    return parserState.keepAlive;
+}
+
+HttpRequest::Method HttpRequest::method() const {
+    return parserState.methodId;
 }
 
 QVariantMap HttpRequest::headers() const {
     QVariantMap ret;
 
-    for (auto it : _headers)
-        ret.insert(QString::fromUtf8(it.first), it.second);
+    for (const auto &field : _headers) {
+        const QString name = QString::fromUtf8(bytes(field.name));
+        auto it = ret.find(name);
+        if (it == ret.end())
+            ret.insert(name, bytes(field.value));
+        else
+            *it = it->toByteArray() + ", " + bytes(field.value);
+    }
     return ret;
 }
 
 QByteArray HttpRequest::body() const {
-    return parserState.content;
+    return parserState.chunked ? parserState.content : bytes(parserState.body);
+}
+
+QIODevice *HttpRequest::bodyDevice() const {
+    return _bodyStream;
 }
 
 QUrl HttpRequest::url() const {
-    return QUrl(parserState.url);
+    auto &target = _target;
+    if (!target.hasUrl) {
+        target.url = QUrl(QString::fromUtf8(bytes(parserState.url)));
+        target.hasUrl = true;
+    }
+    return target.url;
 }
 
-QT_END_NAMESPACE
\ No newline at end of file
+QT_END_NAMESPACE
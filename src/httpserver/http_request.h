@@ -14,14 +14,19 @@
 #include <QtCore/qdebug.h>
 #include <QtCore/qglobal.h>
 #include <QtCore/qurlquery.h>
+#include <QtCore/qvarlengtharray.h>
+#include <QtCore/qvector.h>
 #include <QtNetwork/qhostaddress.h>
 #include <QtCore/qloggingcategory.h>
 
+#include "http_arena.h"
+
 QT_BEGIN_NAMESPACE
 
 class QRegularExpression;
 class QString;
 class QTcpSocket;
+class HttpRequestBody;
 
 class HttpRequest : public QSharedData {
 
@@ -31,49 +36,118 @@ public:
     virtual ~HttpRequest();
 
     enum class Method {
-        Get    = 0x0001,
-        Put    = 0x0002,
-        Delete = 0x0004,
-        Post   = 0x0008,
-        GET    = Get   ,
-        PUT    = Put   ,
-        DELETE = Delete,
-        POST   = Post  ,
-        All = Get | Put | Delete | Post,
+        Unknown = 0x0000,
+        Get     = 0x0001,
+        Put     = 0x0002,
+        Delete  = 0x0004,
+        Post    = 0x0008,
+        Head    = 0x0010,
+        Options = 0x0020,
+        Patch   = 0x0040,
+        GET     = Get    ,
+        PUT     = Put    ,
+        DELETE  = Delete ,
+        POST    = Post   ,
+        HEAD    = Head   ,
+        OPTIONS = Options,
+        PATCH   = Patch  ,
+        All = Get | Put | Delete | Post | Head | Options | Patch,
     };
 
     Q_ENUM(Method)
     Q_DECLARE_FLAGS(Methods, Method)
     Q_FLAG(Methods)
 
+    // Header fields are matched case-insensitively. A repeated field reads
+    // as its values joined with ", ", values() keeps them apart.
     QByteArray value(const QByteArray &key) const;
+    QVector<QByteArray> values(const QByteArray &key) const;
     QUrl url() const;
+    // Path of the request target, percent-decoded.
+    QByteArray path() const;
+    // Query of the request target as sent, without the '?'.
+    QByteArray queryString() const;
+    // Decoded value of the first query item named key: null without one,
+    // empty for a key without '='.
+    QByteArray query(const QByteArray &key) const;
     Method method() const;
     QVariantMap headers() const;
     QByteArray body() const;
 
+    // Only set for routes registered with HttpServer::RouteOption::StreamBody:
+    // the body as it arrives, while body() stays empty. Valid until the next
+    // request on the connection starts.
+    QIODevice *bodyDevice() const;
+
+    // False once the connection will be closed after this message's
+    // response, either because the client asked or the server decided so.
+    bool isKeepAlive() const;
+
 
 protected:
+    /*
+     * Byte range inside the receive buffer. Offsets instead of pointers, so
+     * they survive the buffer being reallocated while it grows.
+     */
+    struct Span {
+        Span() : offset(0), length(0) {}
+        Span(int offset, int length) : offset(offset), length(length) {}
+
+        int offset;
+        int length;
+    };
+
+    struct HeaderField {
+        Span name;
+        Span value;
+    };
+
+    // What a message that fails to parse is answered with.
+    enum class ParseError {
+        Malformed,
+        UnsupportedTransferCoding,
+        BodyTooLarge
+    };
+
     struct HttpParserState {
-        QString method, url;
-        bool upgrade = true;
+        Span method, url;
+        // Resolved from the method token when the request line is parsed.
+        HttpRequest::Method methodId = HttpRequest::Method::Unknown;
+        bool upgrade = false;
         unsigned short http_major = 0, http_minor = 0;
-        QString currentHeaderName;
-        QString currentHeaderValue;
+        Span currentHeaderName;
+        Span currentHeaderValue;
         bool keepAlive = false;
+        // The last transfer coding so far is chunked.
         bool chunked = false;
         size_t contentSize = 0;
+        // Content-Length bodies are referenced in place, chunked ones are
+        // reassembled into content.
+        Span body;
         QByteArray content;
-        QString chunkSizeStr;
         size_t chunkSize = 0;
+        // First byte of the receive buffer the parser hasn't looked at yet.
+        int position = 0;
+        ParseError error = ParseError::Malformed;
     } parserState;
 
     bool handling { false };
+    // Set while a response is still being written asynchronously; the next
+    // pipelined message waits for it so responses go out in order.
+    mutable bool responsePending { false };
+    // Messages answered on this connection so far.
+    int handledCount { 0 };
+
+    HttpRequestBody *_bodyStream { nullptr };
+    // Streaming routes are only looked up once per message.
+    bool streamingChecked { false };
 
 private:
 
     friend class HttpServer;
     friend class HttpResponse;
+    friend class HttpResponder;
+    friend class HttpRouter;
 
 
     Q_DISABLE_COPY(HttpRequest)
@@ -120,25 +194,101 @@ private:
         } state = State::RequestMethodStart;
 
 
-    QByteArray _body;
-
-    QUrl _url;
+    enum class ParseResult {
+        Error,
+        Incomplete,
+        Complete
+    };
 
     QByteArray header(const QByteArray &key) const;
 
     bool parse(QIODevice *socket);
-    size_t parse(const QByteArray &fragment);
+    ParseResult parse();
+
+    bool headersComplete() const;
+    // The whole body as far as known yet: the announced length, or what
+    // arrived of a chunked one plus the rest of its current chunk.
+    qint64 bodySize() const;
+    void startBodyStream(QObject *parent);
+    void drainBody();
+
+    QByteArray bytes(const Span &span) const;
+    // Path part of the request target, without query and fragment, still
+    // percent-encoded.
+    Span pathSpan() const;
+    // Decoded path, as regular expression routes match it.
+    const QString &pathString() const;
+    bool spanEquals(const Span &span, const char *literal) const;
+    bool spanEqualsNoCase(const Span &span, const char *literal) const;
+
+    // Fields looked up for every message; where the first of each is in
+    // _headers is noted while parsing.
+    enum class KnownHeader {
+        Host,
+        ContentLength,
+        ContentType,
+        TransferEncoding,
+        Connection,
+        Upgrade,
+        Accept,
+        AcceptEncoding,
+        IfNoneMatch,
+        IfModifiedSince,
+        Range,
+        IfRange,
+        Count
+    };
 
-    QByteArray lastHeader;
-    QMap<uint, QPair<QByteArray, QByteArray>> _headers;
-    const uint headersSeed = uint(qGlobalQHashSeed());
-    uint headerHash(const QByteArray &key) const;
+    static int knownHeader(const char *name, int length);
+    const HeaderField *findHeader(const char *name, int length) const;
+    void clearHeaders();
+    bool commitHeader(int end);
+    bool commitTransferCodings(const Span &value);
+    // Keep-alive and upgrade, from the Connection options of a complete header.
+    void commitConnectionOptions();
+    // Next element of a comma-separated field value from *from on, without
+    // the whitespace around it; empty elements are skipped.
+    bool nextListElement(const Span &list, int *from, Span *element) const;
+    int skip(const char *(*scan)(const char *, const char *), int pos, int size, Span *span) const;
+
+    // Everything read from the socket for the current message. Spans of
+    // parserState and _headers point into it.
+    QByteArray _buffer;
+    QVarLengthArray<HeaderField, 32> _headers;
+    int knownHeaders[int(KnownHeader::Count)];
+    // What is decoded from the message; emptied along with it.
+    mutable HttpArena _arena;
 
     void clear();
+    void reset(const QHostAddress &remoteAddress);
+
+    // Connections take their request from a per-thread free list and give
+    // it back when the socket goes away, so the buffers keep their capacity.
+    static HttpRequest *acquire(const QHostAddress &remoteAddress);
+    static void release(HttpRequest *request);
 
     QHostAddress _remoteAddress;
 
-    bool parseUrl(const char *at, size_t length, bool connect, QUrl *url);
+    // The request target, split into path and query the first time either
+    // is asked for; what is decoded from it is kept too.
+    struct Target {
+        bool parsed = false;
+        Span path;
+        Span query;
+        // Only set when decoding changed the path; it is in the arena then.
+        // Otherwise the path span is used, which survives reallocation.
+        const char *decodedPath = nullptr;
+        int decodedPathSize = 0;
+        bool pathDecoded = false;
+        QString pathString;
+        bool hasPathString = false;
+        QUrl url;
+        bool hasUrl = false;
+    };
+
+    const Target &parseUrl() const;
+
+    mutable Target _target;
 
     explicit HttpRequest(const QHostAddress &remoteAddress);
 
@@ -149,6 +299,8 @@ private:
 
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(HttpRequest::Methods)
+
 
 inline bool isChar(int c) {
     return c >= 0 && c <= 127;
@@ -174,6 +326,26 @@ inline bool isDigit(int c) {
     return c >= '0' && c <= '9';
 }
 
+inline bool isToken(int c) {
+    return isChar(c) && !isControl(c) && !isSpecial(c);
+}
+
+inline char toLowerAscii(char c) {
+    return (c >= 'A' && c <= 'Z') ? char(c | 0x20) : c;
+}
+
+inline bool equalsNoCase(const char *lhs, int lhsLength, const char *rhs, int rhsLength) {
+    if (lhsLength != rhsLength)
+        return false;
+
+    for (int i = 0; i < lhsLength; ++i) {
+        if (toLowerAscii(lhs[i]) != toLowerAscii(rhs[i]))
+            return false;
+    }
+
+    return true;
+}
+
 QT_END_NAMESPACE
 
 #endif //QT_TCP_SERVER_HTTP_REQUEST_H
@@ -0,0 +1,99 @@
+//
+// Created by kodor on 2/19/22.
+//
+
+#include "http_request_body.h"
+
+#include <cstring>
+
+QT_BEGIN_NAMESPACE
+
+HttpRequestBody::HttpRequestBody(QObject *parent)
+: QIODevice(parent) {
+    // Unbuffered: the data is in our buffer already, QIODevice doesn't need
+    // to keep a second copy.
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+HttpRequestBody::~HttpRequestBody() {}
+
+bool HttpRequestBody::isSequential() const {
+    return true;
+}
+
+qint64 HttpRequestBody::bytesAvailable() const {
+    return unread() + QIODevice::bytesAvailable();
+}
+
+bool HttpRequestBody::atEnd() const {
+    return finished && bytesAvailable() == 0;
+}
+
+bool HttpRequestBody::isFinished() const {
+    return finished;
+}
+
+qint64 HttpRequestBody::freeSpace() const {
+    return qMax<qint64>(highWatermark - unread(), 0);
+}
+
+void HttpRequestBody::append(const char *data, qint64 size) {
+    if (size <= 0)
+        return;
+
+    buffer.append(data, int(size));
+
+    if (!freeSpace())
+        stalled = true;
+
+    Q_EMIT readyRead();
+}
+
+void HttpRequestBody::finish() {
+    if (finished)
+        return;
+
+    finished = true;
+    Q_EMIT readChannelFinished();
+}
+
+qint64 HttpRequestBody::readData(char *data, qint64 maxSize) {
+    const qint64 size = qMin(maxSize, unread());
+
+    if (!size)
+        return finished ? -1 : 0;
+
+    memcpy(data, buffer.constData() + readOffset, size_t(size));
+    readOffset += int(size);
+
+    // Compact once the consumed part dominates, so appends don't keep
+    // growing the buffer.
+    if (readOffset == buffer.size()) {
+        buffer.resize(0);
+        readOffset = 0;
+    } else if (readOffset > buffer.size() / 2) {
+        buffer.remove(0, readOffset);
+        readOffset = 0;
+    }
+
+    if (stalled && unread() <= highWatermark / 2) {
+        stalled = false;
+        Q_EMIT drained();
+    } else if (finished && !unread()) {
+        Q_EMIT drained();
+    }
+
+    return size;
+}
+
+qint64 HttpRequestBody::writeData(const char *data, qint64 size) {
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    return -1;
+}
+
+qint64 HttpRequestBody::unread() const {
+    return buffer.size() - readOffset;
+}
+
+QT_END_NAMESPACE
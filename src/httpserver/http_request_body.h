@@ -0,0 +1,60 @@
+//
+// Created by kodor on 2/19/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_REQUEST_BODY_H
+#define QT_TCP_SERVER_HTTP_REQUEST_BODY_H
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qiodevice.h>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Read-only, sequential view of a request body that is still arriving. The
+ * parser appends to it, the handler reads from it. Once more than
+ * highWatermark bytes are unread the connection stops reading from the
+ * socket, and drained() tells it to continue. drained() also follows the
+ * read that empties a finished body, so the next pipelined request can go.
+ */
+class HttpRequestBody : public QIODevice {
+    Q_OBJECT
+
+public:
+    explicit HttpRequestBody(QObject *parent = nullptr);
+    ~HttpRequestBody();
+
+    bool isSequential() const override;
+    qint64 bytesAvailable() const override;
+    bool atEnd() const override;
+
+    bool isFinished() const;
+
+    // How much the parser may append before the reader has to catch up.
+    qint64 freeSpace() const;
+
+    void append(const char *data, qint64 size);
+    void finish();
+
+    static const qint64 highWatermark = 256 * 1024;
+
+Q_SIGNALS:
+    void drained();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 size) override;
+
+private:
+    qint64 unread() const;
+
+    QByteArray buffer;
+    int readOffset { 0 };
+    bool finished { false };
+    bool stalled { false };
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_REQUEST_BODY_H
@@ -3,17 +3,22 @@
 //
 
 #include "http_content_type.h"
+#include "http_file_transfer.h"
+#include "http_request.h"
 #include "http_response.h"
+#include "http_response_cache.h"
 #include "status_map.h"
 
+#include <QtCore/qdatetime.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qfileinfo.h>
 #include <QtCore/qjsondocument.h>
 #include <QtCore/qmimedatabase.h>
 #include <QtCore/qloggingcategory.h>
-#include <QtCore/qtimer.h>
 #include <QtNetwork/qtcpsocket.h>
 #include <QtCore/QPointer>
 
-#include <map>
+#include <algorithm>
 #include <memory>
 
 
@@ -22,82 +27,159 @@ QT_BEGIN_NAMESPACE
 
 Q_LOGGING_CATEGORY(lcHttpResponse, "httpserver.response")
 
-static const std::map<HttpResponder::StatusCode, QByteArray> statusString {
-#define XX(num, name, string) { static_cast<HttpResponder::StatusCode>(num), QByteArrayLiteral(#string) },
+// Complete "HTTP/1.1 <code> <reason>\r\n" lines as static data; returning
+// one only copies a pointer.
+static QByteArray statusLine(int code) {
+    switch (code) {
+#define XX(num, name, string) case num: return QByteArrayLiteral("HTTP/1.1 " #num " " #string "\r\n");
         HTTP_STATUS_MAP(XX)
 #undef XX
-};
+    }
+    return QByteArray();
+}
+
+static QByteArray reasonPhrase(int code) {
+    switch (code) {
+#define XX(num, name, string) case num: return QByteArrayLiteral(#string);
+        HTTP_STATUS_MAP(XX)
+#undef XX
+    }
+    return QByteArray();
+}
 
-template <quint64 BUFFERSIZE = 512>
+/*
+ * Copies a device to the socket. Reads start at 16 KiB and double while
+ * the source fills them, up to 1 MiB. The socket's write queue is kept
+ * between two watermarks: reading stops once it holds highWatermark bytes
+ * and resumes when it drops below lowWatermark, so a fast source can't
+ * pile its whole content up in QTcpSocket. Sequential devices can be
+ * framed with chunked transfer coding.
+ */
 struct IOChunkedTransfer {
-    const quint64 bufferSize = BUFFERSIZE;
-    char buffer[BUFFERSIZE];
-    quint64  beginIndex = -1;
-    quint64  endIndex = -1;
+    static const int minChunkSize = 16 * 1024;
+    static const int maxChunkSize = 1024 * 1024;
+    static const qint64 highWatermark = 1024 * 1024;
+    static const qint64 lowWatermark = 256 * 1024;
+    // Room in front of the data for the chunk-size line, "fffff\r\n".
+    static const int chunkHeaderRoom = 8;
+
+    QByteArray buffer;
+    int chunkSize = minChunkSize;
+    bool paused = false;
+    bool done = false;
+    const bool chunkedEncoding;
     QPointer<QIODevice> source;
     const QPointer<QIODevice> sink;
+    // Called when the transfer ends while the sink is still around.
+    std::function<void()> finished;
     const QMetaObject::Connection bytesWrittenConnection;
     const QMetaObject::Connection readyReadConnection;
+    const QMetaObject::Connection readChannelFinishedConnection;
 
-    IOChunkedTransfer(QIODevice *input, QIODevice *output) :
+    IOChunkedTransfer(QIODevice *input, QIODevice *output, bool chunked) :
+            chunkedEncoding(chunked),
             source(input),
             sink(output),
             bytesWrittenConnection(QObject::connect(sink.data(), &QIODevice::bytesWritten, [this] () {
-                writeToOutput();
+                pump();
             })),
             readyReadConnection(QObject::connect(source.data(), &QIODevice::readyRead, [this] () {
-                readFromInput();
+                pump();
+            })),
+            readChannelFinishedConnection(QObject::connect(source.data(), &QIODevice::readChannelFinished, [this] () {
+                pump();
             })) {
         Q_ASSERT(!source->atEnd());
         QObject::connect(sink.data(), &QObject::destroyed, source.data(), &QObject::deleteLater);
         QObject::connect(source.data(), &QObject::destroyed, [this] () {
             delete this;
         });
-        readFromInput();
-
+        pump();
     }
 
     ~IOChunkedTransfer() {
         QObject::disconnect(bytesWrittenConnection);
         QObject::disconnect(readyReadConnection);
-    }
+        QObject::disconnect(readChannelFinishedConnection);
 
-    inline bool isBufferEmpty() {
-        Q_ASSERT(beginIndex <= endIndex);
-        return beginIndex == endIndex;
+        if (sink && finished)
+            finished();
     }
 
-    void readFromInput() {
-        if (!isBufferEmpty())
+    void pump() {
+        if (done || !source || !sink)
             return;
-        beginIndex = 0;
-        endIndex = source->read(buffer, bufferSize);
-        if (endIndex < 0) {
-            endIndex = beginIndex;
-            qCWarning(lcHttpResponse, "Error reading chunk: %s", qPrintable(source->errorString()));
-        } else if (endIndex) {
-            memset(buffer + endIndex, 0, sizeof(buffer) - std::size_t(endIndex));
-            writeToOutput();
+
+        if (paused) {
+            if (sink->bytesToWrite() > lowWatermark)
+                return;
+            paused = false;
+        }
+
+        while (!done) {
+            if (sink->bytesToWrite() >= highWatermark) {
+                paused = true;
+                return;
+            }
+
+            const int offset = chunkedEncoding ? chunkHeaderRoom : 0;
+            buffer.resize(offset + chunkSize + 2);
+
+            const qint64 read = source->read(buffer.data() + offset, chunkSize);
+
+            if (read < 0 || (read == 0 && source->atEnd())) {
+                if (read < 0 && !source->atEnd() && source->isOpen())
+                    qCWarning(lcHttpResponse, "Error reading chunk: %s", qPrintable(source->errorString()));
+                finish();
+                return;
+            }
+
+            if (read == 0)
+                return;  // sequential source, more to come with readyRead
+
+            if (!writeChunk(offset, int(read)))
+                return;
+
+            // The source keeps up: fewer, larger reads.
+            if (read == chunkSize && chunkSize < maxChunkSize)
+                chunkSize *= 2;
         }
     }
 
-    void writeToOutput() {
-        if (isBufferEmpty())
-            return;
+    bool writeChunk(int offset, int size) {
+        int begin = offset;
+        int length = size;
 
-        const auto writtenBytes = sink->write(buffer + beginIndex, endIndex);
-        if (writtenBytes < 0) {
-            qCWarning(lcHttpResponse, "Error writing chunk: %s", qPrintable(sink->errorString()));
-            return;
+        if (chunkedEncoding) {
+            char *data = buffer.data();
+            data[offset + size] = '\r';
+            data[offset + size + 1] = '\n';
+
+            data[--begin] = '\n';
+            data[--begin] = '\r';
+            for (int value = size; value; value >>= 4)
+                data[--begin] = "0123456789abcdef"[value & 0xf];
+
+            length = offset + size + 2 - begin;
         }
-        beginIndex += writtenBytes;
-        if (isBufferEmpty()) {
-            if (source->bytesAvailable())
-                QTimer::singleShot(0, source.data(), [this] () { readFromInput(); });
-            else if (source->atEnd())
-                source->deleteLater();
+
+        if (sink->write(buffer.constData() + begin, length) < 0) {
+            qCWarning(lcHttpResponse, "Error writing chunk: %s", qPrintable(sink->errorString()));
+            done = true;
+            source->deleteLater();
+            return false;
         }
 
+        return true;
+    }
+
+    void finish() {
+        done = true;
+
+        if (chunkedEncoding)
+            sink->write("0\r\n\r\n", 5);
+
+        source->deleteLater();
     }
 };
 
@@ -106,11 +188,52 @@ HttpResponder::HttpResponder(const HttpRequest &request, QTcpSocket *socket) :
     Q_ASSERT(socket);
 }
 
-HttpResponder::~HttpResponder() {}
+HttpResponder::HttpResponder(HttpResponder &&other)
+: _request(other._request), _socket(other._socket),
+  _buffer(std::move(other._buffer)), _bodyStarted(other._bodyStarted),
+  _closeConnection(other._closeConnection), _streaming(other._streaming),
+  _chunked(other._chunked), _capture(std::move(other._capture)) {
+    other._buffer.clear();
+    other._streaming = false;
+    other._capture.cache = nullptr;
+}
+
+// Handlers that build the response by hand never say when they're done.
+HttpResponder::~HttpResponder() {
+    if (_streaming)
+        endChunks();
+    flush();
+}
+
+void HttpResponder::flush() {
+    if (_capture.cache)
+        storeInCache();
+
+    if (_buffer.isEmpty())
+        return;
+
+    if (_socket->isOpen())
+        _socket->write(_buffer);
+    _buffer.clear();
+}
+
+void HttpResponder::appendNumber(quint64 value) {
+    char digits[20];
+    int length = 0;
+
+    do {
+        digits[sizeof(digits) - 1 - length++] = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    _buffer.append(digits + sizeof(digits) - length, length);
+}
 
 void HttpResponder::write(QIODevice *data, HeaderList headers, StatusCode status) {
     Q_ASSERT(_socket);
 
+    _capture.cache = nullptr;
+
     QScopedPointer<QIODevice, QScopedPointerDeleteLater> input(data);
 
     input->setParent(nullptr);
@@ -132,24 +255,272 @@ void HttpResponder::write(QIODevice *data, HeaderList headers, StatusCode status
         return;
     }
 
+    const bool chunked = input->isSequential() && acceptsChunked();
+    _closeConnection = input->isSequential() && !chunked;
+
     writeStatusLine(status);
 
-    if (!input->isSequential()) {
-        writeHeader(HttpContentTypes::contentLengthHeader(),
-                    QByteArray::number(input->size()));
-    }
+    if (!input->isSequential())
+        writeHeader(HttpContentTypes::contentLengthHeader(), input->size());
+    else if (chunked)
+        writeHeader(HttpContentTypes::transferEncodingHeader(), HttpContentTypes::transferEncodingChunked());
 
     for (auto &&header : headers)
         writeHeader(header.first, header.second);
 
-    _socket->write("\r\n");
+    _buffer.append("\r\n", 2);
+    _bodyStarted = true;
+
+    // HEAD gets the headers a GET would have, without the body.
+    if (_request.method() == HttpRequest::Method::Head) {
+        flush();
+        return;
+    }
 
     if (input->atEnd()) {
         qCDebug(lcHttpResponse, "No more data available.");
+        if (chunked)
+            _buffer.append("0\r\n\r\n", 5);
+        flush();
+        if (_closeConnection)
+            _socket->disconnectFromHost();
         return;
     }
 
-    new IOChunkedTransfer<>(input.take(), _socket);
+    flush();
+
+    auto transfer = new IOChunkedTransfer(input.take(), _socket, chunked);
+    transfer->finished = holdConnection();
+}
+
+// Without a size up front, HTTP/1.1 clients get the body in chunks;
+// HTTP/1.0 ones have to read until the connection closes.
+bool HttpResponder::acceptsChunked() const {
+    return _request.parserState.http_major > 1 ||
+           (_request.parserState.http_major == 1 && _request.parserState.http_minor >= 1);
+}
+
+std::function<void()> HttpResponder::holdConnection() {
+    // Hold back the next pipelined request until this body is out, then
+    // let the connection pick up where it stopped.
+    const HttpRequest *request = &_request;
+    QTcpSocket *socket = _socket;
+    const bool close = _closeConnection;
+    request->responsePending = true;
+
+    return [request, socket, close] () {
+        request->responsePending = false;
+        if (close)
+            socket->disconnectFromHost();
+        else
+            QMetaObject::invokeMethod(socket, "readyRead", Qt::QueuedConnection);
+    };
+}
+
+// IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT": 29 characters and a NUL.
+static void formatHttpDate(qint64 secsSinceEpoch, char *out) {
+    static const char days[] = "MonTueWedThuFriSatSun";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    const QDateTime time = QDateTime::fromMSecsSinceEpoch(secsSinceEpoch * 1000, Qt::UTC);
+    const QDate date = time.date();
+    const QTime clock = time.time();
+
+    qsnprintf(out, 30, "%.3s, %02d %.3s %04d %02d:%02d:%02d GMT",
+              days + (date.dayOfWeek() - 1) * 3, date.day(),
+              months + (date.month() - 1) * 3, date.year(),
+              clock.hour(), clock.minute(), clock.second());
+}
+
+enum class RangeResult {
+    Ignored,
+    Satisfiable,
+    Unsatisfiable
+};
+
+// Single byte range, RFC 7233 2.1. Multiple ranges are answered with the
+// whole file. *end is exclusive.
+static RangeResult parseRange(const QByteArray &value, qint64 size, qint64 *begin, qint64 *end) {
+    if (!value.startsWith("bytes=") || value.contains(','))
+        return RangeResult::Ignored;
+
+    const QByteArray spec = value.mid(6).trimmed();
+    const int dash = spec.indexOf('-');
+    if (dash < 0)
+        return RangeResult::Ignored;
+
+    bool ok = false;
+
+    if (dash == 0) {
+        const qint64 suffix = spec.mid(1).toLongLong(&ok);
+        if (!ok || suffix < 0)
+            return RangeResult::Ignored;
+        if (suffix == 0 || size == 0)
+            return RangeResult::Unsatisfiable;
+
+        *begin = qMax<qint64>(size - suffix, 0);
+        *end = size;
+        return RangeResult::Satisfiable;
+    }
+
+    const qint64 first = spec.left(dash).toLongLong(&ok);
+    if (!ok || first < 0)
+        return RangeResult::Ignored;
+
+    qint64 last = size - 1;
+    if (dash + 1 < spec.size()) {
+        last = spec.mid(dash + 1).toLongLong(&ok);
+        if (!ok || last < first)
+            return RangeResult::Ignored;
+    }
+
+    if (first >= size)
+        return RangeResult::Unsatisfiable;
+
+    *begin = first;
+    *end = qMin(last + 1, size);
+    return RangeResult::Satisfiable;
+}
+
+static bool etagListContains(const QByteArray &list, const QByteArray &etag) {
+    if (list.trimmed() == "*")
+        return true;
+
+    for (const auto &item : list.split(',')) {
+        QByteArray candidate = item.trimmed();
+        // Weak comparison, RFC 7232 2.3.2.
+        if (candidate.startsWith("W/"))
+            candidate.remove(0, 2);
+        if (candidate == etag)
+            return true;
+    }
+
+    return false;
+}
+
+void HttpResponder::writeFile(const QString &fileName, const QByteArray &mimeType) {
+    _capture.cache = nullptr;
+
+    std::unique_ptr<QFile> file(new QFile(fileName));
+    const QFileInfo info(*file);
+
+    if (!info.isFile() || !file->open(QIODevice::ReadOnly)) {
+        write(StatusCode::NotFound);
+        return;
+    }
+
+    const qint64 size = file->size();
+    const qint64 modified = info.lastModified().toMSecsSinceEpoch() / 1000;
+
+    char lastModified[30];
+    formatHttpDate(modified, lastModified);
+
+    QByteArray etag;
+    etag.reserve(36);
+    etag.append('"');
+    etag.append(QByteArray::number(size, 16));
+    etag.append('-');
+    etag.append(QByteArray::number(modified, 16));
+    etag.append('"');
+
+    bool notModified = false;
+    const QByteArray ifNoneMatch = _request.value("If-None-Match");
+
+    if (!ifNoneMatch.isEmpty()) {
+        notModified = etagListContains(ifNoneMatch, etag);
+    } else {
+        const QByteArray ifModifiedSince = _request.value("If-Modified-Since");
+        if (!ifModifiedSince.isEmpty()) {
+            const QDateTime since = QDateTime::fromString(QString::fromLatin1(ifModifiedSince),
+                                                          Qt::RFC2822Date);
+            notModified = since.isValid() && since.toMSecsSinceEpoch() / 1000 >= modified;
+        }
+    }
+
+    if (notModified) {
+        writeStatusLine(StatusCode::NotModified);
+        writeHeader(HttpContentTypes::etagHeader(), etag);
+        writeHeader(HttpContentTypes::lastModifiedHeader(), QByteArray::fromRawData(lastModified, 29));
+        writeBody(nullptr, 0);
+        flush();
+        return;
+    }
+
+    qint64 begin = 0;
+    qint64 end = size;
+    auto status = StatusCode::Ok;
+
+    const QByteArray range = _request.value("Range");
+    const QByteArray ifRange = _request.value("If-Range");
+
+    if (!range.isEmpty() && (ifRange.isEmpty() || ifRange == etag || ifRange == lastModified)) {
+        switch (parseRange(range, size, &begin, &end)) {
+            case RangeResult::Satisfiable:
+                status = StatusCode::PartialContent;
+                break;
+            case RangeResult::Unsatisfiable: {
+                QByteArray contentRange("bytes */");
+                contentRange.append(QByteArray::number(size));
+
+                writeStatusLine(StatusCode::RangeNotSatisfiable);
+                writeHeader(HttpContentTypes::contentRangeHeader(), contentRange);
+                writeHeader(HttpContentTypes::contentLengthHeader(), qint64(0));
+                writeBody(nullptr, 0);
+                flush();
+                return;
+            }
+            case RangeResult::Ignored:
+                break;
+        }
+    }
+
+    writeStatusLine(status);
+    writeHeader(HttpContentTypes::contentTypeHeader(), !mimeType.isEmpty()
+            ? mimeType
+            : QMimeDatabase().mimeTypeForFile(info, QMimeDatabase::MatchExtension).name().toUtf8());
+    writeHeader(HttpContentTypes::contentLengthHeader(), end - begin);
+    writeHeader(HttpContentTypes::acceptRangesHeader(), HttpContentTypes::acceptRangesBytes());
+    writeHeader(HttpContentTypes::etagHeader(), etag);
+    writeHeader(HttpContentTypes::lastModifiedHeader(), QByteArray::fromRawData(lastModified, 29));
+
+    if (status == StatusCode::PartialContent) {
+        QByteArray contentRange("bytes ");
+        contentRange.append(QByteArray::number(begin));
+        contentRange.append('-');
+        contentRange.append(QByteArray::number(end - 1));
+        contentRange.append('/');
+        contentRange.append(QByteArray::number(size));
+        writeHeader(HttpContentTypes::contentRangeHeader(), contentRange);
+    }
+
+    _buffer.append("\r\n", 2);
+    _bodyStarted = true;
+
+    if (begin == end || _request.method() == HttpRequest::Method::Head) {
+        flush();
+        return;
+    }
+
+#if defined(Q_OS_LINUX)
+    flush();
+
+    auto transfer = new HttpFileTransfer(file.release(), begin, end - begin, _socket);
+    const auto done = holdConnection();
+    QObject::connect(transfer, &HttpFileTransfer::finished, [done] () {
+        done();
+    });
+    transfer->start();
+#else
+    if (const uchar *mapped = file->map(begin, end - begin)) {
+        writeBody(reinterpret_cast<const char *>(mapped), end - begin);
+        flush();
+        file->unmap(const_cast<uchar *>(mapped));
+    } else {
+        flush();
+        file->seek(begin);
+        writeBody(file->read(end - begin));
+    }
+#endif
 }
 
 void HttpResponder::write(QIODevice *data, const QByteArray &mimeType, StatusCode status) {
@@ -159,13 +530,15 @@ void HttpResponder::write(QIODevice *data, const QByteArray &mimeType, StatusCod
 }
 
 void HttpResponder::write(const QJsonDocument &document, HeaderList headers, StatusCode status) {
-    const QByteArray &json = document.toJson();
+    const QByteArray json = document.toJson();
 
+    _buffer.reserve(headerReserve + json.size());
     writeStatusLine(status);
     writeHeader(HttpContentTypes::contentTypeHeader(), HttpContentTypes::contentTypeJson());
-    writeHeader(HttpContentTypes::contentLengthHeader(), QByteArray::number(json.size()));
+    writeHeader(HttpContentTypes::contentLengthHeader(), json.size());
     writeHeaders(std::move(headers));
-    writeBody(document.toJson());
+    writeBody(json);
+    flush();
 }
 
 void HttpResponder::write(const QJsonDocument &document, StatusCode status) {
@@ -183,13 +556,17 @@ void HttpResponder::write(StatusCode status) {
 }
 
 void HttpResponder::write(const QByteArray &data, HeaderList headers, StatusCode status) {
+    if (data.size() <= coalesceLimit)
+        _buffer.reserve(headerReserve + data.size());
+
     writeStatusLine(status);
 
     //for (auto &&header : headers)
     //    writeHeader(header.first, header.second);
 
-    writeHeader(HttpContentTypes::contentLengthHeader(), QByteArray::number(data.size()));
+    writeHeader(HttpContentTypes::contentLengthHeader(), data.size());
     writeBody(data);
+    flush();
 }
 
 void HttpResponder::write(HeaderList headers, StatusCode status) {
@@ -198,23 +575,118 @@ void HttpResponder::write(HeaderList headers, StatusCode status) {
 
 void HttpResponder::writeStatusLine(StatusCode status, const QPair<quint8, quint8> &version) {
     Q_ASSERT(_socket->isOpen());
-    _socket->write("HTTP/");
-    _socket->write(QByteArray::number(version.first));
-    _socket->write(".");
-    _socket->write(QByteArray::number(version.second));
-    _socket->write(" ");
-    _socket->write(QByteArray::number(quint32(status)));
-    _socket->write(" ");
-    _socket->write(statusString.at(status));
-    _socket->write("\r\n");
+
+    if (_buffer.capacity() < headerReserve)
+        _buffer.reserve(headerReserve);
+
+    const QByteArray line = version == qMakePair(quint8(1), quint8(1))
+            ? statusLine(int(status))
+            : QByteArray();
+
+    if (!line.isEmpty()) {
+        _buffer.append(line);
+    } else {
+        _buffer.append("HTTP/", 5);
+        appendNumber(version.first);
+        _buffer.append('.');
+        appendNumber(version.second);
+        _buffer.append(' ');
+        appendNumber(quint32(status));
+        _buffer.append(' ');
+        _buffer.append(reasonPhrase(int(status)));
+        _buffer.append("\r\n", 2);
+    }
+
+    writeDateHeader();
+
+    if (!_request.isKeepAlive() || _closeConnection) {
+        writeHeader(HttpContentTypes::connectionHeader(), HttpContentTypes::connectionClose());
+    } else if (_request.parserState.http_major == 1 && _request.parserState.http_minor == 0) {
+        // HTTP/1.0 closes by default; say that we don't.
+        writeHeader(HttpContentTypes::connectionHeader(), HttpContentTypes::connectionKeepAlive());
+    }
+
+    // Date and Connection differ per response; the rest can be replayed.
+    if (_capture.cache) {
+        if (status == StatusCode::Ok && _capture.from < 0) {
+            _capture.from = _buffer.size();
+            _capture.status = status;
+        } else {
+            _capture.cache = nullptr;
+        }
+    }
+}
+
+void HttpResponder::cacheInto(HttpResponseCache *cache, const QByteArray &key, quint64 version) {
+    _capture.cache = cache;
+    _capture.key = key;
+    _capture.version = version;
+}
+
+void HttpResponder::storeInCache() {
+    if (_capture.from >= 0 && _capture.bodyFrom >= 0) {
+        HttpResponseCache::Entry entry;
+        entry.status = _capture.status;
+        entry.bytes = _buffer.mid(_capture.from);
+        entry.headerLength = _capture.bodyFrom - _capture.from;
+        entry.version = _capture.version;
+        _capture.cache->insert(_capture.key, entry);
+    }
+
+    _capture.cache = nullptr;
+}
+
+void HttpResponder::writeCached(StatusCode status, const QByteArray &bytes, int headerLength) {
+    _buffer.reserve(headerReserve + bytes.size());
+    writeStatusLine(status);
+
+    if (_request.method() == HttpRequest::Method::Head)
+        _buffer.append(bytes.constData(), headerLength);
+    else
+        _buffer.append(bytes);
+
+    _bodyStarted = true;
+    flush();
+}
+
+void HttpResponder::writeDateHeader() {
+    // The date only changes once a second; format it at most that often
+    // per thread and copy it into every response in between.
+    thread_local qint64 cachedSecond = -1;
+    thread_local char cachedDate[30];
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+
+    if (now != cachedSecond) {
+        formatHttpDate(now, cachedDate);
+        cachedSecond = now;
+    }
+
+    _buffer.append(HttpContentTypes::dateHeader());
+    _buffer.append(": ", 2);
+    _buffer.append(cachedDate, 29);
+    _buffer.append("\r\n", 2);
 }
 
 void HttpResponder::writeHeader(const QByteArray &header, const QByteArray &value) {
     Q_ASSERT(_socket->isOpen());
-    _socket->write(header);
-    _socket->write(": ");
-    _socket->write(value);
-    _socket->write("\r\n");
+    _buffer.append(header);
+    _buffer.append(": ", 2);
+    _buffer.append(value);
+    _buffer.append("\r\n", 2);
+}
+
+void HttpResponder::writeHeader(const QByteArray &header, qint64 value) {
+    Q_ASSERT(_socket->isOpen());
+    _buffer.append(header);
+    _buffer.append(": ", 2);
+    if (value < 0) {
+        _buffer.append('-');
+        appendNumber(quint64(-value));
+    } else {
+        appendNumber(quint64(value));
+    }
+    _buffer.append("\r\n", 2);
 }
 
 void HttpResponder::writeHeaders(HeaderList headers) {
@@ -222,15 +694,31 @@ void HttpResponder::writeHeaders(HeaderList headers) {
         writeHeader(header.first, header.second);
 }
 
-void HttpResponder::writeBody(const char *body, qint64 size) {
-    Q_ASSERT(_socket->isOpen());
-
+void HttpResponder::startBody() {
     if (!_bodyStarted) {
-        _socket->write("\r\n");
+        _buffer.append("\r\n", 2);
         _bodyStarted = true;
+        _capture.bodyFrom = _buffer.size();
     }
+}
 
-    _socket->write(body, size);
+void HttpResponder::writeBody(const char *body, qint64 size) {
+    Q_ASSERT(_socket->isOpen());
+
+    startBody();
+
+    if (_request.method() == HttpRequest::Method::Head)
+        return;
+
+    // Small bodies go out together with the header block; large ones are
+    // handed to the socket as they are instead of being copied first.
+    if (_buffer.size() + size <= coalesceLimit) {
+        _buffer.append(body, int(size));
+    } else {
+        _capture.cache = nullptr;
+        flush();
+        _socket->write(body, size);
+    }
 }
 
 void HttpResponder::writeBody(const char *body) {
@@ -241,6 +729,74 @@ void HttpResponder::writeBody(const QByteArray &body) {
     writeBody(body.constData(), body.size());
 }
 
+void HttpResponder::beginChunks(StatusCode status) {
+    // Never complete in the buffer, so never cached.
+    _capture.cache = nullptr;
+
+    _chunked = acceptsChunked();
+    _closeConnection = !_chunked;
+    _streaming = true;
+
+    writeStatusLine(status);
+    if (_chunked)
+        writeHeader(HttpContentTypes::transferEncodingHeader(), HttpContentTypes::transferEncodingChunked());
+}
+
+void HttpResponder::beginChunks(HeaderList headers, StatusCode status) {
+    beginChunks(status);
+    writeHeaders(std::move(headers));
+}
+
+void HttpResponder::writeChunk(const char *data, qint64 size) {
+    Q_ASSERT(_streaming);
+
+    startBody();
+
+    if (!size || _request.method() == HttpRequest::Method::Head)
+        return;
+
+    if (_chunked) {
+        char digits[16];
+        int length = 0;
+        for (quint64 value = quint64(size); value; value >>= 4)
+            digits[sizeof(digits) - 1 - length++] = "0123456789abcdef"[value & 0xf];
+        _buffer.append(digits + sizeof(digits) - length, length);
+        _buffer.append("\r\n", 2);
+    }
+
+    _buffer.append(data, int(size));
+
+    if (_chunked)
+        _buffer.append("\r\n", 2);
+
+    // Hand full buffers over and let the socket push them into the kernel
+    // right away, rather than growing its write queue by the whole body.
+    if (_buffer.size() >= coalesceLimit) {
+        flush();
+        _socket->flush();
+    }
+}
+
+void HttpResponder::writeChunk(const QByteArray &data) {
+    writeChunk(data.constData(), data.size());
+}
+
+void HttpResponder::endChunks() {
+    if (!_streaming)
+        return;
+    _streaming = false;
+
+    startBody();
+
+    if (_chunked && _request.method() != HttpRequest::Method::Head)
+        _buffer.append("0\r\n\r\n", 5);
+
+    flush();
+
+    if (_closeConnection)
+        _socket->disconnectFromHost();
+}
+
 QTcpSocket * HttpResponder::socket() const {
     return _socket;
 }
@@ -296,19 +852,19 @@ HttpResponse::StatusCode HttpResponse::statusCode() const {
 }
 
 void HttpResponse::addHeader(QByteArray &&name, QByteArray &&value) {
-    _headers.emplace(std::move(name), std::move(value));
+    _headers.append(qMakePair(std::move(name), std::move(value)));
 }
 
 void HttpResponse::addHeader(QByteArray &&name, const QByteArray &value) {
-    _headers.emplace(std::move(name), value);
+    _headers.append(qMakePair(std::move(name), value));
 }
 
 void HttpResponse::addHeader(const QByteArray &name, QByteArray &&value) {
-    _headers.emplace(name, std::move(value));
+    _headers.append(qMakePair(name, std::move(value)));
 }
 
 void HttpResponse::addHeader(const QByteArray &name, const QByteArray &value) {
-    _headers.emplace(name, value);
+    _headers.append(qMakePair(name, value));
 }
 
 void HttpResponse::addHeaders(const HttpResponder::HeaderList headers) {
@@ -316,8 +872,15 @@ void HttpResponse::addHeaders(const HttpResponder::HeaderList headers) {
         addHeader(header.first, header.second);
 }
 
+bool HttpResponse::sameName(const QByteArray &lhs, const QByteArray &rhs) {
+    return equalsNoCase(lhs.constData(), lhs.size(), rhs.constData(), rhs.size());
+}
+
 void HttpResponse::clearHeader(const QByteArray &name) {
-    _headers.erase(name);
+    _headers.erase(std::remove_if(_headers.begin(), _headers.end(),
+            [&name] (const QPair<QByteArray, QByteArray> &header) {
+        return sameName(header.first, name);
+    }), _headers.end());
 }
 
 void HttpResponse::clearHeaders() {
@@ -350,28 +913,32 @@ void HttpResponse::setHeaders(HttpResponder::HeaderList headers) {
 }
 
 bool HttpResponse::hasHeader(const QByteArray &name) const {
-    return _headers.find(name) != _headers.end();
+    for (const auto &header : _headers) {
+        if (sameName(header.first, name))
+            return true;
+    }
+
+    return false;
 }
 
 QVector<QByteArray> HttpResponse::headers(const QByteArray &name) const {
     QVector<QByteArray> results;
 
-    auto range = _headers.equal_range(name);
-
-    for (auto it = range.first; it != range.second; ++it)
-        results.append(it->second);
+    for (const auto &header : _headers) {
+        if (sameName(header.first, name))
+            results.append(header.second);
+    }
 
     return results;
 }
 
 bool HttpResponse::hasHeader(const QByteArray &name, const QByteArray &value) const {
-    auto range = _headers.equal_range(name);
-
-    auto condition = [&value] (const std::pair<QByteArray, QByteArray> &pair) {
-        return pair.second == value;
-    };
+    for (const auto &header : _headers) {
+        if (sameName(header.first, name) && header.second == value)
+            return true;
+    }
 
-    return std::find_if(range.first, range.second, condition) != range.second;
+    return false;
 }
 
 void HttpResponse::write(HttpResponder &&responder) const {
@@ -383,10 +950,10 @@ void HttpResponse::write(HttpResponder &&responder) const {
     for (auto &&header : _headers)
         responder.writeHeader(header.first, header.second);
 
-    responder.writeHeader(HttpContentTypes::contentLengthHeader(),
-                          QByteArray::number(_data.size()));
+    responder.writeHeader(HttpContentTypes::contentLengthHeader(), _data.size());
 
     responder.writeBody(_data);
+    responder.flush();
 }
 
 
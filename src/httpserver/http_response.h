@@ -12,11 +12,11 @@
 #include <QtCore/qscopedpointer.h>
 #include <QtCore/qmetatype.h>
 #include <QtCore/qmimetype.h>
+#include <QtCore/qvector.h>
 
 #include <utility>
 #include <initializer_list>
 #include <functional>
-#include <unordered_map>
 
 QT_BEGIN_NAMESPACE
 
@@ -24,26 +24,47 @@ class QTcpSocket;
 class HttpRequest;
 
 class HttpResponderPrivate;
+class HttpResponseCache;
 
 class HttpResponder final {
 
     friend class HttpServer;
+    friend class HttpResponse;
+    friend class HttpBodyWriter;
 
 public:
     enum class StatusCode {
         Continue = 100,
+        SwitchingProtocols = 101,
+
         Ok = 200,
-        BadRequest = 400,
-        InternalServerError = 500,
         Created = 201,
-        Accepted,
-        NoContent,
+        Accepted = 202,
+        NoContent = 204,
+        PartialContent = 206,
 
-        NotFound,
-        Forbidden,
-        BadGateway,
+        MovedPermanently = 301,
+        Found = 302,
+        SeeOther = 303,
+        NotModified = 304,
+        TemporaryRedirect = 307,
+        PermanentRedirect = 308,
 
+        BadRequest = 400,
+        Unauthorized = 401,
+        Forbidden = 403,
+        NotFound = 404,
+        MethodNotAllowed = 405,
+        RequestTimeout = 408,
+        Conflict = 409,
+        PreconditionFailed = 412,
+        PayloadTooLarge = 413,
+        RangeNotSatisfiable = 416,
 
+        InternalServerError = 500,
+        NotImplemented = 501,
+        BadGateway = 502,
+        ServiceUnavailable = 503,
     };
 
     using HeaderList = std::initializer_list<std::pair<QByteArray, QByteArray>>;
@@ -83,20 +104,76 @@ public:
 
 
     void writeHeader(const QByteArray &key, const QByteArray &value);
+    void writeHeader(const QByteArray &key, qint64 value);
     void writeHeaders(HeaderList headers);
 
     void writeBody(const char *body, qint64 size);
     void writeBody(const char *body);
     void writeBody(const QByteArray &body);
 
+    // Body of unknown length, handed over in pieces: chunked for HTTP/1.1
+    // clients, ended by closing the connection for HTTP/1.0 ones. Headers
+    // may follow beginChunks() until the first writeChunk().
+    void beginChunks(StatusCode status = StatusCode::Ok);
+    void beginChunks(HeaderList headers, StatusCode status = StatusCode::Ok);
+    void writeChunk(const char *data, qint64 size);
+    void writeChunk(const QByteArray &data);
+    void endChunks();
+
+    // Regular file with Range, ETag/If-None-Match and Last-Modified/
+    // If-Modified-Since handling. The body is sent with sendfile() where
+    // available. mimeType defaults to a guess from the file name.
+    void writeFile(const QString &fileName, const QByteArray &mimeType = QByteArray());
+
     QTcpSocket *socket() const;
 
 private:
     HttpResponder(const HttpRequest &request, QTcpSocket *socket);
+
+    // Hands everything collected so far to the socket in one write.
+    void flush();
+    // Marks the response as still being written; call the result when done.
+    std::function<void()> holdConnection();
+
+    // Store the response in cache once it is complete, if it is a plain 200
+    // that fits in the buffer.
+    void cacheInto(HttpResponseCache *cache, const QByteArray &key, quint64 version);
+    void storeInCache();
+    void writeCached(StatusCode status, const QByteArray &bytes, int headerLength);
+    void appendNumber(quint64 value);
+    void writeDateHeader();
+    void startBody();
+    // Whether a body without a known length can be sent chunked.
+    bool acceptsChunked() const;
+
+    // Room for a typical status line and header block.
+    static const int headerReserve = 256;
+    // Bodies up to this size are copied behind the headers and written with
+    // them; larger ones are written on their own.
+    static const int coalesceLimit = 64 * 1024;
+
     const HttpRequest &_request;
     QTcpSocket *const _socket;
 
+    // Status line, headers and small bodies, until flush().
+    QByteArray _buffer;
     bool _bodyStarted { false };
+    // The body's end is marked by closing the connection.
+    bool _closeConnection { false };
+    // Between beginChunks() and endChunks().
+    bool _streaming { false };
+    bool _chunked { false };
+
+    struct CacheCapture {
+        HttpResponseCache *cache = nullptr;
+        QByteArray key;
+        quint64 version = 0;
+        StatusCode status = StatusCode::Ok;
+        // Where the cacheable part, after Date and Connection, and the body
+        // start in _buffer.
+        int from = -1;
+        int bodyFrom = -1;
+    } _capture;
 
 };
 
@@ -173,15 +250,12 @@ public:
 
 private:
 
-    struct Hash {
-        std::size_t operator()(const QByteArray &key) const {
-            return qHash(key.toLower());
-        }
-    };
+    static bool sameName(const QByteArray &lhs, const QByteArray &rhs);
 
     QByteArray _data;
     HttpResponse::StatusCode _statusCode;
-    std::unordered_map<QByteArray, QByteArray, Hash> _headers;
+    // In the order they were added; names compare case-insensitively.
+    QVector<QPair<QByteArray, QByteArray>> _headers;
     bool derived { false };
 
 };
@@ -0,0 +1,71 @@
+//
+// Created by kodor on 3/2/22.
+//
+
+#include "http_response_cache.h"
+#include "http_request.h"
+
+#include <QtCore/qurl.h>
+
+QT_BEGIN_NAMESPACE
+
+HttpResponseCache::HttpResponseCache(int maxBytes)
+: cache(maxBytes), _version(0) {}
+
+void HttpResponseCache::setMaxSize(int bytes) {
+    QMutexLocker locker(&mutex);
+    cache.setMaxCost(bytes);
+}
+
+int HttpResponseCache::maxSize() const {
+    return cache.maxCost();
+}
+
+quint64 HttpResponseCache::version() const {
+    return _version.loadAcquire();
+}
+
+void HttpResponseCache::invalidate() {
+    _version.fetchAndAddOrdered(1);
+}
+
+bool HttpResponseCache::find(const QByteArray &key, Entry *entry) {
+    QMutexLocker locker(&mutex);
+
+    const auto cached = cache.object(key);
+    if (!cached)
+        return false;
+
+    if (cached->version != version()) {
+        cache.remove(key);
+        return false;
+    }
+
+    // Copies share the data; the socket write happens after unlocking.
+    *entry = *cached;
+    return true;
+}
+
+void HttpResponseCache::insert(const QByteArray &key, const Entry &entry) {
+    // Built from data that has changed since.
+    if (entry.version != version())
+        return;
+
+    QMutexLocker locker(&mutex);
+    cache.insert(key, new Entry(entry), qMax(entry.bytes.size(), 1));
+}
+
+QByteArray HttpResponseCache::key(const QByteArray &route, const HttpRequest &request) {
+    QByteArray key = route;
+    key.append('\n');
+    key.append(request.path());
+    key.append('?');
+    key.append(request.queryString());
+    key.append('\n');
+    key.append(request.value("Accept"));
+    key.append('\n');
+    key.append(request.value("Accept-Encoding"));
+    return key;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,61 @@
+//
+// Created by kodor on 3/2/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_RESPONSE_CACHE_H
+#define QT_TCP_SERVER_HTTP_RESPONSE_CACHE_H
+
+#include "http_response.h"
+
+#include <QtCore/qatomic.h>
+#include <QtCore/qbytearray.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qmutex.h>
+
+QT_BEGIN_NAMESPACE
+
+class HttpRequest;
+
+/*
+ * Serialised responses of routes registered with
+ * HttpServer::RouteOption::CacheResponse, bounded by their size in bytes
+ * and evicted least recently used first. Every entry remembers the version
+ * it was built under; invalidate() bumps the version and so retires all of
+ * them at once. Shared by all worker threads.
+ */
+class HttpResponseCache {
+public:
+    struct Entry {
+        HttpResponder::StatusCode status;
+        // Headers except Date and Connection, the empty line, the body.
+        QByteArray bytes;
+        int headerLength;
+        quint64 version;
+    };
+
+    explicit HttpResponseCache(int maxBytes = 64 * 1024 * 1024);
+
+    void setMaxSize(int bytes);
+    int maxSize() const;
+
+    quint64 version() const;
+    void invalidate();
+
+    bool find(const QByteArray &key, Entry *entry);
+    void insert(const QByteArray &key, const Entry &entry);
+
+    // Route, normalised URL and the request headers the response may vary on.
+    static QByteArray key(const QByteArray &route, const HttpRequest &request);
+
+private:
+    QMutex mutex;
+    QCache<QByteArray, Entry> cache;
+    QAtomicInteger<quint64> _version;
+
+    Q_DISABLE_COPY(HttpResponseCache)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_RESPONSE_CACHE_H
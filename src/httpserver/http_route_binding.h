@@ -0,0 +1,182 @@
+//
+// Created by kodor on 3/15/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_ROUTE_BINDING_H
+#define QT_TCP_SERVER_HTTP_ROUTE_BINDING_H
+
+#include "http_request.h"
+#include "http_response.h"
+#include "http_router.h"
+#include <storage/key_value_store.h>
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qstring.h>
+
+#include <limits>
+#include <tuple>
+#include <type_traits>
+
+QT_BEGIN_NAMESPACE
+
+// Plain decimal digits, at most max.
+inline bool parseRouteDecimal(const char *data, int size, quint64 max, quint64 *value) {
+    if (size == 0)
+        return false;
+
+    quint64 result = 0;
+    for (int i = 0; i < size; ++i) {
+        if (!isDigit(data[i]))
+            return false;
+
+        const quint64 digit = quint64(data[i] - '0');
+        if (result > (max - digit) / 10)
+            return false;
+        result = result * 10 + digit;
+    }
+
+    *value = result;
+    return true;
+}
+
+/*
+ * Turns one decoded path capture into a handler parameter. A capture
+ * that doesn't convert answers the request with 404.
+ */
+template <typename T, typename Enable = void>
+struct HttpRouteArgument;
+
+template <typename T>
+struct HttpRouteArgument<T, typename std::enable_if<std::is_integral<T>::value &&
+                                                    std::is_unsigned<T>::value &&
+                                                    !std::is_same<T, bool>::value>::type> {
+    static bool convert(const char *data, int size, T *value) {
+        quint64 result;
+        if (!parseRouteDecimal(data, size, quint64(std::numeric_limits<T>::max()), &result))
+            return false;
+        *value = T(result);
+        return true;
+    }
+};
+
+template <typename T>
+struct HttpRouteArgument<T, typename std::enable_if<std::is_integral<T>::value &&
+                                                    std::is_signed<T>::value>::type> {
+    static bool convert(const char *data, int size, T *value) {
+        const bool negative = size > 0 && data[0] == '-';
+        const quint64 max = quint64(std::numeric_limits<T>::max()) + (negative ? 1 : 0);
+
+        quint64 result;
+        if (!parseRouteDecimal(data + negative, size - negative, max, &result))
+            return false;
+        *value = negative ? T(-qint64(result - 1) - 1) : T(result);
+        return true;
+    }
+};
+
+template <>
+struct HttpRouteArgument<QByteArray> {
+    static bool convert(const char *data, int size, QByteArray *value) {
+        *value = QByteArray(data, size);
+        return true;
+    }
+};
+
+template <>
+struct HttpRouteArgument<QString> {
+    static bool convert(const char *data, int size, QString *value) {
+        *value = QString::fromUtf8(data, size);
+        return true;
+    }
+};
+
+template <int... I>
+struct HttpIndices {};
+
+template <int N, int... I>
+struct HttpMakeIndices : HttpMakeIndices<N - 1, N - 1, I...> {};
+
+template <int... I>
+struct HttpMakeIndices<0, I...> {
+    typedef HttpIndices<I...> Type;
+};
+
+template <typename Handler>
+struct HttpHandlerSignature : HttpHandlerSignature<decltype(&Handler::operator())> {};
+
+template <typename Class, typename Result, typename... Arguments>
+struct HttpHandlerSignature<Result (Class::*)(Arguments...) const> {
+    typedef std::tuple<Arguments...> Parameters;
+};
+
+template <typename Class, typename Result, typename... Arguments>
+struct HttpHandlerSignature<Result (Class::*)(Arguments...)> {
+    typedef std::tuple<Arguments...> Parameters;
+};
+
+template <typename Result, typename... Arguments>
+struct HttpHandlerSignature<Result (*)(Arguments...)> {
+    typedef std::tuple<Arguments...> Parameters;
+};
+
+/*
+ * Calls a route handler whose leading parameters take the path captures,
+ * e.g. (quint64 id, KeyValueStore &, const HttpRequest &, HttpResponder &&)
+ * for "/items/<id>". The parameter types are read off the handler, so
+ * each route gets its own converters and calls the handler directly.
+ */
+template <typename Handler>
+class HttpRouteBinding {
+    typedef typename HttpHandlerSignature<Handler>::Parameters Parameters;
+
+public:
+    static const int argumentCount = int(std::tuple_size<Parameters>::value) - 3;
+
+    static_assert(argumentCount >= 0, "route handlers end in "
+                  "(KeyValueStore &, const HttpRequest &, HttpResponder &&)");
+
+    static void invoke(Handler &handler, const HttpRouteMatch &match, KeyValueStore &store,
+                       const HttpRequest &request, HttpResponder &&responder) {
+        invoke(handler, typename HttpMakeIndices<argumentCount>::Type(), match, store, request,
+               std::move(responder));
+    }
+
+private:
+    template <int I>
+    using Argument = typename std::decay<typename std::tuple_element<I, Parameters>::type>::type;
+
+    template <int... I>
+    static void invoke(Handler &handler, HttpIndices<I...>, const HttpRouteMatch &match,
+                       KeyValueStore &store, const HttpRequest &request,
+                       HttpResponder &&responder) {
+        Q_UNUSED(match);
+
+        std::tuple<Argument<I>...> arguments;
+        bool converted = true;
+        // Braced lists are evaluated in order; the first failure stops it.
+        const bool expand[] = { true, (converted = converted &&
+                                       convert(match, I, &std::get<I>(arguments)))... };
+        Q_UNUSED(expand);
+
+        if (!converted) {
+            responder.write(HttpResponder::StatusCode::NotFound);
+            return;
+        }
+
+        handler(std::move(std::get<I>(arguments))..., store, request, std::move(responder));
+    }
+
+    template <typename T>
+    static bool convert(const HttpRouteMatch &match, int index, T *value) {
+        QByteArray storage;
+        const char *data;
+        int size;
+
+        return match.capturedData(index, &data, &size, &storage) &&
+               HttpRouteArgument<T>::convert(data, size, value);
+    }
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_ROUTE_BINDING_H
@@ -9,6 +9,7 @@
 #include <QtCore/qstringbuilder.h>
 #include <QtCore/qdebug.h>
 
+#include <cstring>
 #include <utility>
 
 QT_BEGIN_NAMESPACE
@@ -24,32 +25,307 @@ static HttpRequest::Methods strToMethods(const char *strMethods) {
     const int val = methodEnum.keysToValue(strMethods, &ok);
     if (ok)
         methods = static_cast<decltype(methods)>(val);
+    else
         qCWarning(lcRouter, "Can't convert %s to HttpRequest::Method", strMethods);
     return methods;
 }
 
+// HttpRouter::MethodCount has to cover every method bit.
+Q_STATIC_ASSERT(int(HttpRequest::Method::All) == (1 << 7) - 1);
+
+/*
+ * Match
+ */
+
+HttpRouteMatch::HttpRouteMatch() {}
+
+HttpRouteMatch::~HttpRouteMatch() {}
+
+const HttpRoute *HttpRouteMatch::route() const {
+    return _route;
+}
+
+int HttpRouteMatch::capturedCount() const {
+    if (regexMatch)
+        return regexMatch->lastCapturedIndex();
+    return captures.size();
+}
+
+QByteArray HttpRouteMatch::captured(int index) const {
+    if (regexMatch)
+        return regexMatch->captured(index + 1).toUtf8();
+
+    if (index < 0 || index >= captures.size())
+        return QByteArray();
+
+    const auto &capture = captures.at(index);
+    return QByteArray(capture.data, capture.size);
+}
+
+bool HttpRouteMatch::capturedData(int index, const char **data, int *size,
+                                  QByteArray *storage) const {
+    if (regexMatch) {
+        if (index < 0 || index >= regexMatch->lastCapturedIndex())
+            return false;
+        *storage = regexMatch->captured(index + 1).toUtf8();
+        *data = storage->constData();
+        *size = storage->size();
+        return true;
+    }
+
+    if (index < 0 || index >= captures.size())
+        return false;
+
+    *data = captures.at(index).data;
+    *size = captures.at(index).size;
+    return true;
+}
+
+QByteArray HttpRouteMatch::captured(const QByteArray &name) const {
+    if (regexMatch)
+        return regexMatch->captured(QString::fromUtf8(name)).toUtf8();
+
+    if (!_route)
+        return QByteArray();
+
+    return captured(_route->parameterNames().indexOf(name));
+}
+
+/*
+ * Router
+ */
+
 HttpRouter::HttpRouter() {}
 
 HttpRouter::~HttpRouter() {}
 
 bool HttpRouter::addRoute(HttpRoute *route) {
-    if (!route->hasValidMethods() || !route->createPathRegexp()) {
+    if (!route->hasValidMethods()) {
         qCWarning(lcRouter, "Route has no valid methods. Skip Route");
         delete route;
         return false;
     }
 
+    const bool tree = route->isTreePattern();
+
+    if (!tree && !route->createPathRegexp()) {
+        qCWarning(lcRouter) << "Invalid route pattern" << route->pathPattern << "Skip Route";
+        delete route;
+        return false;
+    }
+
+    if (route->captureCount() < route->_argumentCount) {
+        qCWarning(lcRouter) << "Route pattern" << route->pathPattern
+                            << "captures less than its handler takes. Skip Route";
+        delete route;
+        return false;
+    }
+
+    if (route->streamBody())
+        ++_streamingRoutes;
+
+    if (tree) {
+        insert(route);
+        _treeRoutes.emplace_back(route);
+        return true;
+    }
+
+    for (int i = 0; i < MethodCount; ++i) {
+        if (route->methods & HttpRequest::Method(1 << i))
+            _regexRoutes[i].push_back(route);
+    }
+
     _routes.emplace_back(route);
     return true;
 }
 
-bool HttpRouter::handleRequest(const HttpRequest &request, QTcpSocket *socket) const {
-    for (const auto &route : qAsConst(_routes)) {
-        if (route->exec(request, socket))
+void HttpRouter::insert(HttpRoute *route) {
+    const QByteArray pattern = route->pathPattern.toUtf8();
+    const char *data = pattern.constData();
+    const int size = pattern.size();
+
+    Node *node = &_tree;
+    int pos = 0;
+
+    while (pos < size) {
+        if (data[pos] == '<') {
+            const int end = pattern.indexOf('>', pos);
+            route->_parameterNames.append(pattern.mid(pos + 1, end - pos - 1));
+
+            if (!node->parameter)
+                node->parameter.reset(new Node);
+            node = node->parameter.get();
+            pos = end + 1;
+        } else {
+            int end = pattern.indexOf('<', pos);
+            if (end < 0)
+                end = size;
+
+            node = insertStatic(node, data + pos, end - pos);
+            pos = end;
+        }
+    }
+
+    for (int i = 0; i < MethodCount; ++i) {
+        if (route->methods & HttpRequest::Method(1 << i))
+            node->routes[i].push_back(route);
+    }
+}
+
+HttpRouter::Node *HttpRouter::insertStatic(Node *node, const char *label, int length) {
+    while (length > 0) {
+        Node *next = nullptr;
+
+        for (const auto &child : node->children) {
+            if (child->label.at(0) == label[0]) {
+                next = child.get();
+                break;
+            }
+        }
+
+        if (!next) {
+            std::unique_ptr<Node> child(new Node);
+            child->label = QByteArray(label, length);
+            next = child.get();
+            node->children.push_back(std::move(child));
+            return next;
+        }
+
+        int common = 0;
+        const int limit = qMin(length, next->label.size());
+        while (common < limit && next->label.at(common) == label[common])
+            ++common;
+
+        if (common < next->label.size()) {
+            // Split the edge: next keeps the shared prefix, its old contents
+            // move one level down.
+            std::unique_ptr<Node> tail(new Node);
+            tail->label = next->label.mid(common);
+            tail->children = std::move(next->children);
+            tail->parameter = std::move(next->parameter);
+            tail->routes = std::move(next->routes);
+
+            next->label.truncate(common);
+            next->children.clear();
+            for (auto &routes : next->routes)
+                routes.clear();
+            next->children.push_back(std::move(tail));
+        }
+
+        node = next;
+        label += common;
+        length -= common;
+    }
+
+    return node;
+}
+
+int HttpRouter::methodIndex(HttpRequest::Method method) {
+    if (method == HttpRequest::Method::Unknown)
+        return -1;
+    return int(qCountTrailingZeroBits(quint32(method)));
+}
+
+bool HttpRouter::accepts(const HttpRoute *route, bool streamingOnly) {
+    return !streamingOnly || route->streamBody();
+}
+
+const HttpRoute *HttpRouter::matchNode(const Node *node, const char *path, int length, int pos,
+                                       int method, bool streamingOnly, HttpRouteMatch *match) {
+    if (pos == length) {
+        for (const auto route : node->routes[method]) {
+            if (accepts(route, streamingOnly))
+                return route;
+        }
+        return nullptr;
+    }
+
+    // Static edges first, so /users/new wins over /users/<id>.
+    for (const auto &child : node->children) {
+        const auto &label = child->label;
+
+        if (label.at(0) != path[pos])
+            continue;
+
+        if (length - pos >= label.size() &&
+            memcmp(path + pos, label.constData(), size_t(label.size())) == 0) {
+            if (const auto route = matchNode(child.get(), path, length, pos + label.size(),
+                                             method, streamingOnly, match))
+                return route;
+        }
+        break;
+    }
+
+    if (node->parameter) {
+        const void *slash = memchr(path + pos, '/', size_t(length - pos));
+        const int end = slash ? int(static_cast<const char *>(slash) - path) : length;
+
+        if (end > pos) {
+            match->captures.append(HttpRouteMatch::Capture { path + pos, end - pos });
+
+            if (const auto route = matchNode(node->parameter.get(), path, length, end,
+                                             method, streamingOnly, match))
+                return route;
+
+            match->captures.removeLast();
+        }
+    }
+
+    return nullptr;
+}
+
+bool HttpRouter::findRoute(const HttpRequest &request, HttpRouteMatch *match, bool streamingOnly) const {
+    const int method = methodIndex(request.method());
+    if (method < 0)
+        return false;
+
+    const auto path = request.pathSpan();
+
+    match->captures.clear();
+    match->_route = matchNode(&_tree, request._buffer.constData() + path.offset, path.length, 0,
+                              method, streamingOnly, match);
+    if (match->_route) {
+        // Moved into the request's arena, decoded on the way: a streamed
+        // body reallocates the receive buffer before the handler runs.
+        for (auto &capture : match->captures) {
+            const char *data = request._arena.decodePercent(capture.data, &capture.size);
+            capture.data = data != capture.data ? data
+                                                : request._arena.copy(data, capture.size);
+        }
+        return true;
+    }
+
+    match->captures.clear();
+
+    for (const auto route : _regexRoutes[method]) {
+        if (accepts(route, streamingOnly) && route->matches(request, match)) {
+            match->_route = route;
             return true;
+        }
     }
 
-    return true;
+    return false;
+}
+
+bool HttpRouter::handleRequest(const HttpRequest &request, QTcpSocket *socket) const {
+    HttpRouteMatch match;
+
+    if (!findRoute(request, &match, false))
+        return false;
+
+    return handleRequest(match, request, socket);
+}
+
+bool HttpRouter::handleRequest(const HttpRouteMatch &match, const HttpRequest &request, QTcpSocket *socket) const {
+    return match.route()->exec(match, request, socket);
+}
+
+bool HttpRouter::findStreamingRoute(const HttpRequest &request, HttpRouteMatch *match) const {
+    return findRoute(request, match, true);
+}
+
+bool HttpRouter::hasStreamingRoutes() const {
+    return _streamingRoutes > 0;
 }
 
 
@@ -71,29 +347,49 @@ HttpRoute::HttpRoute(QString pathPattern, const char *methods, RouterHandler &&r
 
 HttpRoute::~HttpRoute() {}
 
-bool HttpRoute::hasValidMethods() const {
-    return methods & HttpRequest::Method::All;
+void HttpRoute::setStreamBody(bool enabled) {
+    _streamBody = enabled;
 }
 
-bool HttpRoute::exec(const HttpRequest &request, QTcpSocket *socket) const {
-    QRegularExpressionMatch match;
+bool HttpRoute::streamBody() const {
+    return _streamBody;
+}
 
-    if (!matches(request, &match)) {
-        qCDebug(lcRouter) << "not match!";
-        return false;
-    }
+const QVector<QByteArray> &HttpRoute::parameterNames() const {
+    return _parameterNames;
+}
+
+void HttpRoute::setArgumentCount(int count) {
+    _argumentCount = count;
+}
+
+int HttpRoute::captureCount() const {
+    return isTreePattern() ? pathPattern.count(QLatin1Char('<')) : _pathRegexp.captureCount();
+}
+
+bool HttpRoute::hasValidMethods() const {
+    return methods & HttpRequest::Method::All;
+}
 
+bool HttpRoute::exec(const HttpRouteMatch &match, const HttpRequest &request, QTcpSocket *socket) const {
     routerHandler(match, request, socket);
     qCDebug(lcRouter) << " match!";
     return true;
 }
 
-bool HttpRoute::matches(const HttpRequest &request, QRegularExpressionMatch *match) const {
-    if (methods && !(methods & request.method()))
+bool HttpRoute::isTreePattern() const {
+    static const QRegularExpression treePattern(
+            QStringLiteral("^(/([A-Za-z0-9\\-_~!&',;=:@%]+|<[A-Za-z_][A-Za-z0-9_]*>)?)+$"));
+    return treePattern.match(pathPattern).hasMatch();
+}
+
+bool HttpRoute::matches(const HttpRequest &request, HttpRouteMatch *match) const {
+    auto regexMatch = _pathRegexp.match(request.pathString());
+    if (!regexMatch.hasMatch())
         return false;
 
-    *match = _pathRegexp.match(request.url().path());
-    return (match->hasMatch());
+    match->regexMatch.reset(new QRegularExpressionMatch(std::move(regexMatch)));
+    return true;
 }
 
 bool HttpRoute::createPathRegexp() {
@@ -105,7 +401,7 @@ bool HttpRoute::createPathRegexp() {
 
     _pathRegexp.setPattern(pathRegexp);
     _pathRegexp.optimize();
-    return true;
+    return _pathRegexp.isValid();
 }
 
-QT_END_NAMESPACE
\ No newline at end of file
+QT_END_NAMESPACE
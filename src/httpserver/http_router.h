@@ -6,10 +6,15 @@
 #define QT_TCP_SERVER_HTTP_ROUTER_H
 
 #include <QtCore/qmap.h>
+#include <QtCore/qvarlengtharray.h>
 
+#include <array>
+#include <list>
 #include <memory>
+#include <vector>
 #include "http_request.h"
 #include "http_response.h"
+#include <storage/key_value_store.h>
 
 QT_BEGIN_NAMESPACE
 
@@ -23,31 +28,99 @@ class QTcpSocket;
 class HttpRequest;
 class HttpRoute;
 
+/*
+ * What a route captured from the path: the <name> segments of a tree route,
+ * decoded into the request's arena and valid until the message is done,
+ * or the capture groups of a regular expression route.
+ */
+class HttpRouteMatch {
+public:
+    HttpRouteMatch();
+    ~HttpRouteMatch();
+
+    const HttpRoute *route() const;
+
+    int capturedCount() const;
+    QByteArray captured(int index) const;
+    QByteArray captured(const QByteArray &name) const;
+    // Capture index without a copy where it can: tree captures point into
+    // the request, regular expression ones are converted into *storage.
+    bool capturedData(int index, const char **data, int *size, QByteArray *storage) const;
+
+private:
+    friend class HttpRouter;
+
+    struct Capture {
+        const char *data;
+        int size;
+    };
+
+    const HttpRoute *_route { nullptr };
+    QVarLengthArray<Capture, 8> captures;
+    std::unique_ptr<QRegularExpressionMatch> regexMatch;
+
+    Q_DISABLE_COPY(HttpRouteMatch)
+
+};
+
 class HttpRouter {
 public:
     HttpRouter();
     ~HttpRouter();
 
-    template <typename ViewHandler>
-    std::function<void(QMap<quint8, QByteArray> &, QList<QString> &, const HttpRequest &, HttpResponder &&)>
-            bindCaptured(ViewHandler &&handler, const QRegularExpressionMatch &match) const {
-        return handler;
-    }
-
     bool handleRequest(const HttpRequest &request, QTcpSocket *socket) const;
+    bool handleRequest(const HttpRouteMatch &match, const HttpRequest &request, QTcpSocket *socket) const;
+
+    // Routes that want the body as a stream are dispatched as soon as the
+    // headers are in, so they are looked up on their own.
+    bool findStreamingRoute(const HttpRequest &request, HttpRouteMatch *match) const;
+    bool hasStreamingRoutes() const;
 
 
     bool addRoute(HttpRoute *route);
 
 private:
+    /*
+     * Compressed radix tree over the raw request path. Static edges carry
+     * a label, a parameter child takes one whole path segment.
+     */
+    enum { MethodCount = 7 };
+
+    // One slot per HttpRequest::Method bit, so a lookup only ever sees the
+    // routes registered for the request's method.
+    template <typename T>
+    using MethodTable = std::array<T, MethodCount>;
+
+    struct Node {
+        QByteArray label;
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> parameter;
+        MethodTable<std::vector<HttpRoute *>> routes;
+    };
+
+    bool findRoute(const HttpRequest &request, HttpRouteMatch *match, bool streamingOnly) const;
+
+    void insert(HttpRoute *route);
+    static Node *insertStatic(Node *node, const char *label, int length);
+    static int methodIndex(HttpRequest::Method method);
+    static bool accepts(const HttpRoute *route, bool streamingOnly);
+    static const HttpRoute *matchNode(const Node *node, const char *path, int length, int pos,
+                                      int method, bool streamingOnly, HttpRouteMatch *match);
+
+    Node _tree;
+    // Routes whose pattern needs a regular expression, tried in order after
+    // the tree.
     std::list<std::unique_ptr<HttpRoute>> _routes;
+    MethodTable<std::vector<HttpRoute *>> _regexRoutes;
+    std::vector<std::unique_ptr<HttpRoute>> _treeRoutes;
+    int _streamingRoutes { 0 };
 
 };
 
 class HttpRoute {
 
 public:
-    using RouterHandler = std::function<void(const QRegularExpressionMatch &, const HttpRequest &,
+    using RouterHandler = std::function<void(const HttpRouteMatch &, const HttpRequest &,
             QTcpSocket *)>;
 
     explicit HttpRoute(const QString &pathPattern, RouterHandler &&routerHandler);
@@ -61,15 +134,29 @@ public:
 
     virtual ~HttpRoute();
 
+    void setStreamBody(bool enabled);
+    bool streamBody() const;
+
+    // Names of the <name> segments, in path order.
+    const QVector<QByteArray> &parameterNames() const;
+
+    // Captures the handler takes; a pattern with fewer is not added.
+    void setArgumentCount(int count);
+    int captureCount() const;
+
 protected:
-    bool exec(const HttpRequest &request, QTcpSocket *socket) const;
+    bool exec(const HttpRouteMatch &match, const HttpRequest &request, QTcpSocket *socket) const;
 
     bool hasValidMethods() const;
 
+    // Patterns made of literal segments and <name> segments go into the
+    // router's tree; anything else is compiled to a regular expression.
+    bool isTreePattern() const;
+
     bool createPathRegexp();
 
     virtual bool matches(const HttpRequest &request,
-                         QRegularExpressionMatch *match) const;
+                         HttpRouteMatch *match) const;
 
 
 private:
@@ -78,6 +165,9 @@ private:
     HttpRoute::RouterHandler routerHandler;
 
     QRegularExpression _pathRegexp;
+    bool _streamBody { false };
+    int _argumentCount { 0 };
+    QVector<QByteArray> _parameterNames;
 
     friend class HttpRouter;
 
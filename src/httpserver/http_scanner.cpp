@@ -0,0 +1,212 @@
+//
+// Created by kodor on 2/14/22.
+//
+
+#include "http_scanner.h"
+#include "http_request.h"
+
+#include <QtCore/qalgorithms.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define HTTP_SCANNER_SSE2
+#  include <emmintrin.h>
+#endif
+
+#if defined(HTTP_SCANNER_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#  define HTTP_SCANNER_AVX2
+#  include <immintrin.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Scalar versions, used for the tail shorter than a vector and on CPUs
+ * without SSE2.
+ */
+
+static const char *findTokenEndScalar(const char *begin, const char *end) {
+    while (begin != end && isToken(*begin))
+        ++begin;
+    return begin;
+}
+
+static const char *findFieldValueEndScalar(const char *begin, const char *end) {
+    while (begin != end && !isControl(*begin))
+        ++begin;
+    return begin;
+}
+
+static const char *findRequestTargetEndScalar(const char *begin, const char *end) {
+    while (begin != end && *begin != ' ' && !isControl(*begin))
+        ++begin;
+    return begin;
+}
+
+#if defined(HTTP_SCANNER_SSE2)
+
+/*
+ * Bytes are compared as signed: everything from 0x80 up is negative, which
+ * makes it fail the token range check for free and has to be masked out
+ * explicitly where it is allowed (values, target).
+ */
+
+static inline __m128i tokenDelimiters(__m128i v) {
+    // isSpecial() minus SP and HT, which the range check already rejects.
+    static const char specials[] = "()<>@,;:\\\"/[]?={}";
+
+    __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x21)),
+                               _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+    for (size_t i = 0; i < sizeof(specials) - 1; ++i)
+        bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(specials[i])));
+
+    return bad;
+}
+
+static inline __m128i controlCharacters(__m128i v, char below) {
+    const __m128i high = _mm_cmplt_epi8(v, _mm_setzero_si128());
+    const __m128i low = _mm_cmplt_epi8(v, _mm_set1_epi8(below));
+    return _mm_or_si128(_mm_andnot_si128(high, low),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+}
+
+static const char *findTokenEndSse2(const char *begin, const char *end) {
+    for (; end - begin >= 16; begin += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+        const int mask = _mm_movemask_epi8(tokenDelimiters(v));
+        if (mask)
+            return begin + qCountTrailingZeroBits(quint32(mask));
+    }
+
+    return findTokenEndScalar(begin, end);
+}
+
+static const char *findFieldValueEndSse2(const char *begin, const char *end) {
+    for (; end - begin >= 16; begin += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+        const int mask = _mm_movemask_epi8(controlCharacters(v, 0x20));
+        if (mask)
+            return begin + qCountTrailingZeroBits(quint32(mask));
+    }
+
+    return findFieldValueEndScalar(begin, end);
+}
+
+static const char *findRequestTargetEndSse2(const char *begin, const char *end) {
+    for (; end - begin >= 16; begin += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+        const int mask = _mm_movemask_epi8(controlCharacters(v, 0x21));
+        if (mask)
+            return begin + qCountTrailingZeroBits(quint32(mask));
+    }
+
+    return findRequestTargetEndScalar(begin, end);
+}
+
+#endif
+
+#if defined(HTTP_SCANNER_AVX2)
+
+#define HTTP_SCANNER_TARGET_AVX2 __attribute__((target("avx2")))
+
+HTTP_SCANNER_TARGET_AVX2
+static inline __m256i tokenDelimiters256(__m256i v) {
+    static const char specials[] = "()<>@,;:\\\"/[]?={}";
+
+    __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x21), v),
+                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+
+    for (size_t i = 0; i < sizeof(specials) - 1; ++i)
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(specials[i])));
+
+    return bad;
+}
+
+HTTP_SCANNER_TARGET_AVX2
+static inline __m256i controlCharacters256(__m256i v, char below) {
+    const __m256i high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+    const __m256i low = _mm256_cmpgt_epi8(_mm256_set1_epi8(below), v);
+    return _mm256_or_si256(_mm256_andnot_si256(high, low),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+}
+
+HTTP_SCANNER_TARGET_AVX2
+static const char *findTokenEndAvx2(const char *begin, const char *end) {
+    for (; end - begin >= 32; begin += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+        const quint32 mask = quint32(_mm256_movemask_epi8(tokenDelimiters256(v)));
+        if (mask)
+            return begin + qCountTrailingZeroBits(mask);
+    }
+
+    return findTokenEndSse2(begin, end);
+}
+
+HTTP_SCANNER_TARGET_AVX2
+static const char *findFieldValueEndAvx2(const char *begin, const char *end) {
+    for (; end - begin >= 32; begin += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+        const quint32 mask = quint32(_mm256_movemask_epi8(controlCharacters256(v, 0x20)));
+        if (mask)
+            return begin + qCountTrailingZeroBits(mask);
+    }
+
+    return findFieldValueEndSse2(begin, end);
+}
+
+HTTP_SCANNER_TARGET_AVX2
+static const char *findRequestTargetEndAvx2(const char *begin, const char *end) {
+    for (; end - begin >= 32; begin += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+        const quint32 mask = quint32(_mm256_movemask_epi8(controlCharacters256(v, 0x21)));
+        if (mask)
+            return begin + qCountTrailingZeroBits(mask);
+    }
+
+    return findRequestTargetEndSse2(begin, end);
+}
+
+#undef HTTP_SCANNER_TARGET_AVX2
+
+#endif
+
+namespace {
+
+typedef const char *(*ScanFunction)(const char *, const char *);
+
+struct ScannerTable {
+    ScanFunction tokenEnd;
+    ScanFunction fieldValueEnd;
+    ScanFunction requestTargetEnd;
+};
+
+ScannerTable selectScanners() {
+#if defined(HTTP_SCANNER_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return { findTokenEndAvx2, findFieldValueEndAvx2, findRequestTargetEndAvx2 };
+#endif
+#if defined(HTTP_SCANNER_SSE2)
+    return { findTokenEndSse2, findFieldValueEndSse2, findRequestTargetEndSse2 };
+#else
+    return { findTokenEndScalar, findFieldValueEndScalar, findRequestTargetEndScalar };
+#endif
+}
+
+const ScannerTable scanners = selectScanners();
+
+}
+
+const char *HttpScanner::findTokenEnd(const char *begin, const char *end) {
+    return scanners.tokenEnd(begin, end);
+}
+
+const char *HttpScanner::findFieldValueEnd(const char *begin, const char *end) {
+    return scanners.fieldValueEnd(begin, end);
+}
+
+const char *HttpScanner::findRequestTargetEnd(const char *begin, const char *end) {
+    return scanners.requestTargetEnd(begin, end);
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,33 @@
+//
+// Created by kodor on 2/14/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_SCANNER_H
+#define QT_TCP_SERVER_HTTP_SCANNER_H
+
+#include <QtCore/qglobal.h>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Bulk scanners for the request parser. Each returns the first byte in
+ * [begin, end) that ends the current run, or end. They look at 16 (SSE2) or
+ * 32 (AVX2) bytes at a time where the CPU allows it, the implementation is
+ * picked once at startup, and fall back to the per-byte checks of
+ * http_request.h otherwise.
+ */
+class HttpScanner {
+public:
+    // First byte that is not a token character (method, header name).
+    static const char *findTokenEnd(const char *begin, const char *end);
+
+    // First control character (end of a header value).
+    static const char *findFieldValueEnd(const char *begin, const char *end);
+
+    // First space or control character (end of the request target).
+    static const char *findRequestTargetEnd(const char *begin, const char *end);
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_SCANNER_H
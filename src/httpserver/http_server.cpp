@@ -5,15 +5,30 @@
 #include <QTcpServer>
 #include "http_server.h"
 #include "http_request.h"
+#include "http_request_body.h"
 #include "http_response.h"
 #include "http_router.h"
+#include "http_worker.h"
+#include <storage/sharded_hash_store.h>
 
+#include <QtCore/qdir.h>
 #include <QtCore/qloggingcategory.h>
 #include <QtCore/qmetaobject.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qtimer.h>
 #include <QtNetwork/qtcpserver.h>
 #include <QtNetwork/qtcpsocket.h>
 
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 QT_BEGIN_NAMESPACE
 
@@ -24,60 +39,374 @@ void HttpServer::handleNewConnections() {
 
     Q_ASSERT(tcpServer);
 
-    while (auto socket = tcpServer->nextPendingConnection()) {
-        auto request = new HttpRequest(socket->peerAddress());
-        QObject::connect(socket, &QTcpSocket::readyRead, this,
-                [this, request, socket] {
-            handleReadyRead(socket, request);
-        });
+    while (auto socket = tcpServer->nextPendingConnection())
+        handleConnection(socket);
+}
 
-        QObject::connect(socket, &QTcpSocket::disconnected, socket, [request, socket] () {
-            if (!request->handling)
-                socket->deleteLater();
-        });
+void HttpServer::handleConnection(QTcpSocket *socket) {
+    auto request = HttpRequest::acquire(socket->peerAddress());
 
-        QObject::connect(socket, &QObject::destroyed, socket, [request] () {
-            delete request;
+    // The socket is the context object: it lives in the thread that has to
+    // parse and answer on it, which is not necessarily ours.
+    QObject::connect(socket, &QTcpSocket::readyRead, socket,
+            [this, request, socket] {
+        handleReadyRead(socket, request);
+    });
+
+    // Idle connections are closed; any traffic either way counts as activity.
+    if (_keepAliveTimeout > 0) {
+        auto idleTimer = new QTimer(socket);
+        idleTimer->setSingleShot(true);
+        idleTimer->setInterval(_keepAliveTimeout);
+
+        QObject::connect(idleTimer, &QTimer::timeout, socket, [request, socket] () {
+            if (!request->handling && !request->responsePending) {
+                qCDebug(lcHttpServer) << "Closing idle connection from" << socket->peerAddress();
+                socket->disconnectFromHost();
+            }
         });
+        QObject::connect(socket, &QTcpSocket::readyRead, idleTimer,
+                static_cast<void (QTimer::*)()>(&QTimer::start));
+        QObject::connect(socket, &QTcpSocket::bytesWritten, idleTimer,
+                static_cast<void (QTimer::*)()>(&QTimer::start));
+
+        idleTimer->start();
+    }
+
+    QObject::connect(socket, &QTcpSocket::disconnected, socket, [request, socket] () {
+        if (!request->handling)
+            socket->deleteLater();
+    });
+
+    QObject::connect(socket, &QObject::destroyed, socket, [request] () {
+        HttpRequest::release(request);
+    });
+}
+
+bool HttpServer::dispatchConnection(qintptr socketDescriptor) {
+    if (_workers.isEmpty())
+        return false;
+
+    auto worker = *std::min_element(_workers.cbegin(), _workers.cend(),
+            [](const HttpWorker *lhs, const HttpWorker *rhs) {
+        return lhs->connectionCount() < rhs->connectionCount();
+    });
+
+    worker->assign(socketDescriptor);
+    return true;
+}
+
+void HttpServer::setWorkerThreadCount(int count) {
+    stopWorkers();
+
+    for (int i = 0; i < count; ++i) {
+        auto thread = new QThread(this);
+        thread->setObjectName(QStringLiteral("HttpWorker %1").arg(i));
+
+        auto worker = new HttpWorker(this);
+        worker->moveToThread(thread);
+        QObject::connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+
+        thread->start();
+
+        _threads.append(thread);
+        _workers.append(worker);
     }
 }
 
+int HttpServer::workerThreadCount() const {
+    return _threads.size();
+}
+
+void HttpServer::stopWorkers() {
+    for (auto thread : qAsConst(_threads)) {
+        thread->quit();
+        thread->wait();
+        delete thread;
+    }
+
+    _threads.clear();
+    _workers.clear();
+}
+
 void HttpServer::handleReadyRead(QTcpSocket *socket, HttpRequest *request) {
     Q_ASSERT(socket);
     Q_ASSERT(request);
 
+    // The previous response is still being written. Its transfer raises
+    // readyRead again once it is done, so responses stay in request order.
+    if (request->responsePending)
+        return;
 
-    if (!socket->isTransactionStarted())
-        socket->startTransaction();
-
-    if (request->state == HttpRequest::State::MessageComplete)
-        request->clear();
+    if (request->state == HttpRequest::State::MessageComplete) {
+        // A streaming handler has not read all of its body yet; drained()
+        // brings us back.
+        if (request->_bodyStream && !request->_bodyStream->atEnd())
+            return;
 
-    if (!request->parse(socket)) {
-        socket->disconnect();
-        return;
+        if (!finishMessage(socket, request))
+            return;
     }
 
+    for (;;) {
+        if (!request->parse(socket)) {
+            rejectMessage(socket, request);
+            return;
+        }
 
-    if (!request->parserState.upgrade &&
-    request->state != HttpRequest::State::MessageComplete)
-        return;
+        if (!request->streamingChecked && request->headersComplete()) {
+            request->streamingChecked = true;
+
+            HttpRouteMatch match;
+
+            if (_router.hasStreamingRoutes() && _router.findStreamingRoute(*request, &match)) {
+                request->startBodyStream(socket);
+
+                // Stop Qt from buffering more than the handler has room for,
+                // and pick up again once it has read enough.
+                socket->setReadBufferSize(HttpRequestBody::highWatermark);
+                QObject::connect(request->_bodyStream, &HttpRequestBody::drained, socket,
+                        [this, request, socket] {
+                    handleReadyRead(socket, request);
+                }, Qt::QueuedConnection);
+
+                if (!dispatch(match, socket, request))
+                    return;
+            }
+        }
+
+        if (!request->_bodyStream && _maxBodySize && request->headersComplete()
+                && request->bodySize() > _maxBodySize) {
+            request->parserState.error = HttpRequest::ParseError::BodyTooLarge;
+            rejectMessage(socket, request);
+            return;
+        }
+
+        if (request->_bodyStream) {
+            // Already dispatched; the parser only feeds the body device now.
+            if (request->state != HttpRequest::State::MessageComplete)
+                return;
+
+            socket->setReadBufferSize(0);
+
+            if (!request->_bodyStream->atEnd())
+                return;
+        } else {
+            if (!request->parserState.upgrade &&
+            request->state != HttpRequest::State::MessageComplete)
+                return;
+
+            HttpRouteMatch unmatched;
+
+            if (!dispatch(unmatched, socket, request))
+                return;
+        }
+
+        if (request->responsePending)
+            return;
+
+        if (!finishMessage(socket, request))
+            return;
+    }
+}
+
+bool HttpServer::dispatch(const HttpRouteMatch &match, QTcpSocket *socket, HttpRequest *request) {
+    // Decide now whether this is the last message, so the response can say
+    // Connection: close.
+    if (_maxRequestsPerConnection > 0 && request->handledCount + 1 >= _maxRequestsPerConnection)
+        request->parserState.keepAlive = false;
 
-    socket->commitTransaction();
     request->handling = true;
 
-    if (!handleRequest(*request, socket))
+    if (match.route())
+        _router.handleRequest(match, *request, socket);
+    else if (!handleRequest(*request, socket))
         Q_EMIT missingHandler(*request, socket);
 
     request->handling = false;
 
-    if (socket->state() == QAbstractSocket::UnconnectedState)
+    if (socket->state() == QAbstractSocket::UnconnectedState) {
         socket->deleteLater();
+        return false;
+    }
 
+    return true;
+}
+
+bool HttpServer::finishMessage(QTcpSocket *socket, HttpRequest *request) {
+    // Upgraded connections belong to their handler from here on.
+    if (request->parserState.upgrade)
+        return false;
+
+    ++request->handledCount;
+
+    if (!request->parserState.keepAlive) {
+        // Queued response bytes are still flushed before the close.
+        socket->disconnectFromHost();
+        return false;
+    }
+
+    request->clear();
+    return true;
+}
+
+void HttpServer::rejectMessage(QTcpSocket *socket, HttpRequest *request) {
+    // Nothing after the error can be framed, so the connection ends here.
+    // A streaming handler already has the message and answers it itself.
+    if (!request->_bodyStream) {
+        request->parserState.keepAlive = false;
+
+        auto status = HttpResponder::StatusCode::BadRequest;
+        if (request->parserState.error == HttpRequest::ParseError::UnsupportedTransferCoding)
+            status = HttpResponder::StatusCode::NotImplemented;
+        else if (request->parserState.error == HttpRequest::ParseError::BodyTooLarge)
+            status = HttpResponder::StatusCode::PayloadTooLarge;
+
+        makeResponder(*request, socket).write(status);
+    }
+
+    socket->disconnectFromHost();
+}
+
+void HttpServer::setKeepAliveTimeout(int msecs) {
+    _keepAliveTimeout = msecs;
+}
+
+int HttpServer::keepAliveTimeout() const {
+    return _keepAliveTimeout;
+}
+
+void HttpServer::setMaxRequestsPerConnection(int count) {
+    _maxRequestsPerConnection = count;
+}
+
+int HttpServer::maxRequestsPerConnection() const {
+    return _maxRequestsPerConnection;
+}
+
+void HttpServer::setMaxBodySize(qint64 bytes) {
+    _maxBodySize = qMax<qint64>(0, bytes);
+}
+
+qint64 HttpServer::maxBodySize() const {
+    return _maxBodySize;
+}
+
+void HttpServer::setReusePort(bool enabled) {
+    _reusePort = enabled;
+}
+
+bool HttpServer::reusePort() const {
+    return _reusePort;
+}
+
+/*
+ * QTcpServer can't set SO_REUSEPORT before binding, so the listening socket
+ * is created by hand and adopted with setSocketDescriptor().
+ */
+static qintptr openReusePortSocket(const QHostAddress &address, quint16 *port) {
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+    sockaddr_storage storage;
+    socklen_t length;
+    memset(&storage, 0, sizeof(storage));
+
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        auto addr = reinterpret_cast<sockaddr_in *>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(*port);
+        addr->sin_addr.s_addr = htonl(address.toIPv4Address());
+        length = sizeof(sockaddr_in);
+    } else {
+        // AnyIPProtocol binds the dual-stack IPv6 wildcard, like QTcpServer does.
+        auto addr = reinterpret_cast<sockaddr_in6 *>(&storage);
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(*port);
+        if (address.protocol() == QAbstractSocket::IPv6Protocol) {
+            const Q_IPV6ADDR ip = address.toIPv6Address();
+            memcpy(&addr->sin6_addr, &ip, sizeof(ip));
+        }
+        length = sizeof(sockaddr_in6);
+    }
+
+    const int fd = ::socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        qCCritical(lcHttpServer, "socket() failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    const int on = 1;
+    const int off = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        (address.protocol() == QAbstractSocket::AnyIPProtocol &&
+         ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) ||
+        ::bind(fd, reinterpret_cast<sockaddr *>(&storage), length) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0) {
+        qCCritical(lcHttpServer, "failed to listen %s:%d (%s)",
+                   qPrintable(address.toString()), *port, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    // With port 0 every following socket has to join the one we were given.
+    if (!*port && ::getsockname(fd, reinterpret_cast<sockaddr *>(&storage), &length) == 0) {
+        *port = storage.ss_family == AF_INET
+                ? ntohs(reinterpret_cast<sockaddr_in *>(&storage)->sin_port)
+                : ntohs(reinterpret_cast<sockaddr_in6 *>(&storage)->sin6_port);
+    }
+
+    return fd;
+#else
+    Q_UNUSED(address);
+    Q_UNUSED(port);
+    return -1;
+#endif
+}
+
+quint16 HttpServer::listenReusePort(const QHostAddress &address, quint16 port) {
+    for (auto worker : qAsConst(_workers)) {
+        const auto fd = openReusePortSocket(address, &port);
+        bool listening = false;
+
+        if (fd >= 0) {
+            QMetaObject::invokeMethod(worker, "listenOn", Qt::BlockingQueuedConnection,
+                                      Q_RETURN_ARG(bool, listening),
+                                      Q_ARG(qintptr, fd));
+#if defined(Q_OS_UNIX)
+            if (!listening)
+                ::close(int(fd));
+#endif
+        }
+
+        if (!listening) {
+            // All or nothing: the workers that already listen stop again.
+            for (auto other : qAsConst(_workers)) {
+                if (other == worker)
+                    break;
+                QMetaObject::invokeMethod(other, "closeLastListener", Qt::BlockingQueuedConnection);
+            }
+            return 0;
+        }
+    }
+
+    return port;
 }
 
 quint16 HttpServer::listen(const QHostAddress &address, quint16 port) {
-    auto tcpServer = new QTcpServer(this);
+    if (_reusePort) {
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+        if (!_workers.isEmpty())
+            return listenReusePort(address, port);
+        qCWarning(lcHttpServer, "SO_REUSEPORT listeners need worker threads, using a single listener");
+#else
+        qCWarning(lcHttpServer, "SO_REUSEPORT is not supported here, using a single listener");
+#endif
+    }
+
+    auto tcpServer = new HttpTcpServer(this, this);
 
     const auto listening = tcpServer->listen(address, port);
 
@@ -105,13 +434,21 @@ void HttpServer::bind(QTcpServer *server) {
             qCWarning(lcHttpServer) << "The TCP server" << server << "is not listening.";
         server->setParent(this);
     }
+
+    if (!_servers.contains(server)) {
+        _servers.append(server);
+        QObject::connect(server, &QObject::destroyed, this, [this, server] () {
+            _servers.removeAll(server);
+        });
+    }
+
     QObject::connect(server, &QTcpServer::newConnection, this, &HttpServer::handleNewConnections,
                      Qt::UniqueConnection);
 }
 
 QVector<quint16> HttpServer::serverPorts() {
     QVector<quint16> ports;
-    auto children = findChildren<QTcpServer *>();
+    auto children = servers();
     ports.reserve(children.count());
     std::transform(children.cbegin(), children.cend(), std::back_inserter(ports),
             [](const QTcpServer *server) { return server->serverPort(); });
@@ -119,7 +456,13 @@ QVector<quint16> HttpServer::serverPorts() {
 }
 
 QVector<QTcpServer *> HttpServer::servers() const {
-    return findChildren<QTcpServer *>().toVector();
+    auto servers = _servers;
+
+    // SO_REUSEPORT listeners belong to the worker that accepts on them.
+    for (auto worker : _workers)
+        servers += worker->listeners();
+
+    return servers;
 }
 
 HttpResponder HttpServer::makeResponder(const HttpRequest &request, QTcpSocket *socket) {
@@ -127,15 +470,21 @@ HttpResponder HttpServer::makeResponder(const HttpRequest &request, QTcpSocket *
 }
 
 
-HttpServer::HttpServer(QObject *parent) {
+HttpServer::HttpServer(QObject *parent)
+: QObject(parent), _store(new ShardedHashStore) {
+    qRegisterMetaType<qintptr>("qintptr");
+
+    // Emitted from whichever thread owns the socket, so it must not be queued.
     connect(this, &HttpServer::missingHandler, this,
             [=] (const HttpRequest &request, QTcpSocket *socket) {
-        qCDebug(lcHttpServer) << "Missing handler: " << request.url().path();
+        qCDebug(lcHttpServer) << "Missing handler: " << request.path();
         sendResponse(HttpResponder::StatusCode::NotFound, request, socket);
-    });
+    }, Qt::DirectConnection);
 }
 
-HttpServer::~HttpServer() {}
+HttpServer::~HttpServer() {
+    stopWorkers();
+}
 
 HttpRouter * HttpServer::router() {
     return &_router;
@@ -147,6 +496,70 @@ void HttpServer::sendResponse(HttpResponse &&response,
     response.write(makeResponder(request, socket));
 }
 
+bool HttpServer::routeStaticFiles(const QString &urlPrefix, const QString &rootDirectory) {
+    QString prefix = urlPrefix;
+    while (prefix.endsWith(QLatin1Char('/')))
+        prefix.chop(1);
+
+    const QString root = QDir(rootDirectory).absolutePath();
+
+    auto route = new HttpRoute(
+            QStringLiteral("^%1/(.+)$").arg(QRegularExpression::escape(prefix)),
+            HttpRequest::Method::Get | HttpRequest::Method::Head,
+            [root] (const HttpRouteMatch &match, const HttpRequest &request, QTcpSocket *socket) {
+        const QString relative = QString::fromUtf8(match.captured(0));
+
+        // Nothing outside the root, whatever the path says.
+        if (relative.split(QLatin1Char('/')).contains(QStringLiteral(".."))) {
+            makeResponder(request, socket).write(HttpResponder::StatusCode::NotFound);
+            return;
+        }
+
+        makeResponder(request, socket).writeFile(root + QLatin1Char('/') + relative);
+    });
+
+    return router()->addRoute(route);
+}
+
+bool HttpServer::answerFromCache(const QByteArray &key, const HttpRequest &request,
+                                 QTcpSocket *socket) {
+    HttpResponseCache::Entry entry;
+
+    if (!_responseCache.find(key, &entry))
+        return false;
+
+    makeResponder(request, socket).writeCached(entry.status, entry.bytes, entry.headerLength);
+    return true;
+}
+
+void HttpServer::setStore(KeyValueStore *store) {
+    _store.reset(store);
+}
+
+KeyValueStore *HttpServer::store() const {
+    return _store.get();
+}
+
+void HttpServer::setResponseCacheSize(int bytes) {
+    _responseCache.setMaxSize(bytes);
+}
+
+void HttpServer::invalidateResponseCache() {
+    _responseCache.invalidate();
+}
+
+void HttpServer::invalidateCacheAfter(const HttpRequest &request) {
+    switch (request.method()) {
+        case HttpRequest::Method::Get:
+        case HttpRequest::Method::Head:
+        case HttpRequest::Method::Options:
+            break;
+        default:
+            _responseCache.invalidate();
+            break;
+    }
+}
+
 bool HttpServer::handleRequest(const HttpRequest &request, QTcpSocket *socket) {
     return _router.handleRequest(request, socket);
 }
@@ -6,17 +6,24 @@
 
 #include "http_request.h"
 #include "http_response.h"
+#include "http_route_binding.h"
 #include "http_router.h"
 #include "http_content_type.h"
+#include "http_response_cache.h"
+#include <storage/key_value_store.h>
 
 #include <QtCore/qobject.h>
+#include <QtCore/qvector.h>
 #include <QtNetwork/qhostaddress.h>
+#include <memory>
 #include <tuple>
 
 QT_BEGIN_NAMESPACE
 
 class QTcpServer;
 class QTcpSocket;
+class QThread;
+class HttpWorker;
 
 
 class HttpServer : public QObject {
@@ -32,35 +39,157 @@ public:
     HttpRouter *router();
 
     using ViewHandler = std::function<void(
-            QMap<quint8, QByteArray> &table,
-            QList<QString> &transactionLog,
+            KeyValueStore &store,
             const HttpRequest &request,
             HttpResponder &&responder)>;
     using BoundHandler = std::function<void(
-            QMap<quint8, QByteArray> &table,
-            QList<QString> &transactionLog,
+            KeyValueStore &store,
             const HttpRequest &request,
             HttpResponder &&responder)>;
 
-    bool route(QString &&pathPattern, ViewHandler &&handler) {
+    enum class RouteOption {
+        NoOptions  = 0x0,
+        // Run the handler once the headers are parsed and hand it the body
+        // through HttpRequest::bodyDevice() as it arrives.
+        StreamBody = 0x1,
+        // Keep GET responses in the response cache and answer repeated
+        // requests from it until a non-idempotent request runs.
+        CacheResponse = 0x2,
+    };
+    Q_DECLARE_FLAGS(RouteOptions, RouteOption)
+
+    /*
+     * A handler takes (KeyValueStore &, const HttpRequest &, HttpResponder &&),
+     * preceded by one parameter per path capture it wants, converted from
+     * the capture, e.g.
+     *
+     *   route("/items/<id>", [] (quint64 id, KeyValueStore &store,
+     *                            const HttpRequest &request, HttpResponder &&responder) { ... });
+     *
+     * Integer, QByteArray and QString parameters are supported; a capture
+     * that isn't a number in range is answered with 404.
+     */
+    template <typename Handler>
+    bool route(QString &&pathPattern, Handler &&handler) {
+        return route(std::move(pathPattern), HttpRequest::Method::All,
+                     RouteOption::NoOptions, std::forward<Handler>(handler));
+    }
+
+    template <typename Handler>
+    bool route(QString &&pathPattern, RouteOptions options, Handler &&handler) {
+        return route(std::move(pathPattern), HttpRequest::Method::All,
+                     options, std::forward<Handler>(handler));
+    }
+
+    template <typename Handler>
+    bool route(QString &&pathPattern, HttpRequest::Methods methods, Handler &&handler) {
+        return route(std::move(pathPattern), methods, RouteOption::NoOptions,
+                     std::forward<Handler>(handler));
+    }
 
-        auto routerHandler = [this, handler] (
-                const QRegularExpressionMatch &match,
+    template <typename Handler>
+    bool route(QString &&pathPattern, HttpRequest::Methods methods, RouteOptions options,
+               Handler &&handler) {
+        typedef typename std::decay<Handler>::type Callable;
+        typedef HttpRouteBinding<Callable> Binding;
+
+        const bool cacheResponse = options.testFlag(RouteOption::CacheResponse);
+        const QByteArray cacheRoute = pathPattern.toUtf8();
+
+        auto routerHandler = [this, handler, cacheResponse, cacheRoute] (
+                const HttpRouteMatch &match,
                 const HttpRequest &request,
                 QTcpSocket *socket) mutable {
-            auto boundHandler = router()->bindCaptured<ViewHandler>(std::move(handler), match);
-            response(boundHandler, request, socket);
+            auto boundHandler = [&handler, &match] (KeyValueStore &store,
+                                                    const HttpRequest &request,
+                                                    HttpResponder &&responder) {
+                Binding::invoke(handler, match, store, request, std::move(responder));
+            };
+            if (cacheResponse)
+                cachedResponse(boundHandler, cacheRoute, request, socket);
+            else
+                response(boundHandler, request, socket);
         };
-        return router()->addRoute(new HttpRoute(std::forward<QString>(pathPattern),
-                                                std::move(routerHandler)));
+        auto route = new HttpRoute(std::forward<QString>(pathPattern), methods,
+                                   std::move(routerHandler));
+        route->setStreamBody(options.testFlag(RouteOption::StreamBody));
+        route->setArgumentCount(Binding::argumentCount);
+        return router()->addRoute(route);
     }
 
-    void response(BoundHandler &boundHandler, const HttpRequest &request, QTcpSocket *socket) {
+    // Serve the files below rootDirectory under urlPrefix, e.g.
+    // routeStaticFiles("/files", "/srv/www") answers /files/a/b.txt with
+    // /srv/www/a/b.txt. GET and HEAD only.
+    bool routeStaticFiles(const QString &urlPrefix, const QString &rootDirectory);
+
+    template <typename Bound>
+    void response(Bound &boundHandler, const HttpRequest &request, QTcpSocket *socket) {
         //HttpResponse response(boundHandler(request));
         //sendResponse(std::move(response), request, socket);
-        boundHandler(table, transactionLog, request, makeResponder(request, socket));
+        boundHandler(*_store, request, makeResponder(request, socket));
+        invalidateCacheAfter(request);
     }
 
+    template <typename Bound>
+    void cachedResponse(Bound &boundHandler, const QByteArray &route,
+                        const HttpRequest &request, QTcpSocket *socket) {
+        const auto method = request.method();
+
+        if (method != HttpRequest::Method::Get && method != HttpRequest::Method::Head) {
+            response(boundHandler, request, socket);
+            return;
+        }
+
+        const QByteArray key = HttpResponseCache::key(route, request);
+        if (answerFromCache(key, request, socket))
+            return;
+
+        // Taken before the handler runs: a change it doesn't see yet then
+        // always outdates what it builds.
+        auto responder = makeResponder(request, socket);
+        if (method == HttpRequest::Method::Get)
+            responder.cacheInto(&_responseCache, key, _responseCache.version());
+
+        boundHandler(*_store, request, std::move(responder));
+    }
+
+    // Takes ownership. Defaults to an in-memory ShardedHashStore; wrap it in
+    // a DurableStore to keep the data across restarts. Handlers call it from
+    // every worker thread at once. Has to be set before listen().
+    void setStore(KeyValueStore *store);
+    KeyValueStore *store() const;
+
+    // Bytes the response cache may hold; 64 MiB by default.
+    void setResponseCacheSize(int bytes);
+    // Drop every cached response. Non-idempotent requests do this
+    // themselves once their handler has run.
+    void invalidateResponseCache();
+
+    // 0 keeps every connection on the thread that owns the listening
+    // server. Has to be set before listen().
+    void setWorkerThreadCount(int count);
+    int workerThreadCount() const;
+
+    // Open one SO_REUSEPORT listening socket per worker thread on the same
+    // address and port and let the kernel balance connections between them.
+    // Needs worker threads; has to be set before listen().
+    void setReusePort(bool enabled);
+    bool reusePort() const;
+
+    // Keep-alive connections are closed after this long without traffic,
+    // and after answering this many requests. 0 disables either limit.
+    void setKeepAliveTimeout(int msecs);
+    int keepAliveTimeout() const;
+    void setMaxRequestsPerConnection(int count);
+    int maxRequestsPerConnection() const;
+
+    // Bodies the server would buffer beyond this many bytes are answered
+    // with 413; 64 MiB by default, 0 for no limit. Streamed bodies (see
+    // RouteOption::StreamBody) aren't buffered and aren't limited. Has to
+    // be set before listen().
+    void setMaxBodySize(qint64 bytes);
+    qint64 maxBodySize() const;
+
     quint16 listen(const QHostAddress &address = QHostAddress::Any, quint16 port = 0);
     QVector<quint16> serverPorts();
 
@@ -68,7 +197,12 @@ public:
     QVector<QTcpServer *> servers() const;
 
     void handleNewConnections();
+    void handleConnection(QTcpSocket *socket);
+    bool dispatchConnection(qintptr socketDescriptor);
     void handleReadyRead(QTcpSocket *socket, HttpRequest *request);
+    bool dispatch(const HttpRouteMatch &match, QTcpSocket *socket, HttpRequest *request);
+    bool finishMessage(QTcpSocket *socket, HttpRequest *request);
+    void rejectMessage(QTcpSocket *socket, HttpRequest *request);
 
     bool handleRequest(const HttpRequest &request, QTcpSocket *socket);
 
@@ -83,13 +217,28 @@ protected:
     static HttpResponder makeResponder(const HttpRequest &request, QTcpSocket *socket);
 
 private:
+    void stopWorkers();
+    void invalidateCacheAfter(const HttpRequest &request);
+    bool answerFromCache(const QByteArray &key, const HttpRequest &request, QTcpSocket *socket);
+    quint16 listenReusePort(const QHostAddress &address, quint16 port);
 
     HttpRouter _router;
     QTcpServer *tcpServer;
-    QMap<quint8, QByteArray> table;
-    QList<QString> transactionLog;
+    std::unique_ptr<KeyValueStore> _store;
+
+    QVector<QThread *> _threads;
+    QVector<HttpWorker *> _workers;
+    // Listeners bound on this thread; workers keep their own.
+    QVector<QTcpServer *> _servers;
+    bool _reusePort { false };
+    HttpResponseCache _responseCache;
+    int _keepAliveTimeout { 15000 };
+    int _maxRequestsPerConnection { 1000 };
+    qint64 _maxBodySize { 64 * 1024 * 1024 };
 
 
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(HttpServer::RouteOptions)
+
 QT_END_NAMESPACE
\ No newline at end of file
@@ -0,0 +1,147 @@
+//
+// Created by kodor on 3/13/22.
+//
+
+#include "http_template.h"
+
+#include <QtCore/qloggingcategory.h>
+
+QT_BEGIN_NAMESPACE
+
+Q_LOGGING_CATEGORY(lcTemplate, "httpserver.template")
+
+HttpTemplate::Argument::Argument(const char *text)
+: kind(Kind::Text), text(text), size(int(qstrlen(text))) {}
+
+HttpTemplate::Argument::Argument(const QByteArray &text)
+: kind(Kind::Text), text(text.constData()), size(text.size()) {}
+
+HttpTemplate::Argument::Argument(const QString &text)
+: kind(Kind::Text), converted(text.toUtf8()) {
+    this->text = converted.constData();
+    size = converted.size();
+}
+
+HttpTemplate::Argument::Argument(int number)
+: Argument(qint64(number)) {}
+
+HttpTemplate::Argument::Argument(qint64 number)
+: kind(Kind::Number), number(number < 0 ? quint64(0) - quint64(number) : quint64(number)),
+  negative(number < 0) {}
+
+HttpTemplate::Argument::Argument(quint64 number)
+: kind(Kind::Number), number(number) {}
+
+HttpTemplate::Argument::Argument(const std::function<void(HttpBodyWriter &)> &content)
+: kind(Kind::Content), content(content) {}
+
+HttpTemplate::HttpTemplate(const QByteArray &source, std::initializer_list<const char *> names)
+: source(source) {
+    int from = 0;
+
+    for (;;) {
+        const int open = source.indexOf("{{", from);
+        const int close = open < 0 ? -1 : source.indexOf("}}", open + 2);
+
+        if (close < 0) {
+            parts.append({ from, source.size() - from, -1, false });
+            break;
+        }
+
+        QByteArray name = source.mid(open + 2, close - open - 2).trimmed();
+        const bool raw = name.startsWith('&');
+        if (raw)
+            name = name.mid(1).trimmed();
+
+        int slot = 0;
+        for (const char *candidate : names) {
+            if (name == candidate)
+                break;
+            ++slot;
+        }
+
+        if (slot == int(names.size())) {
+            // Left in the output as it is.
+            qCWarning(lcTemplate, "unknown slot %s", name.constData());
+            parts.append({ from, close + 2 - from, -1, false });
+        } else {
+            parts.append({ from, open - from, slot, raw });
+        }
+
+        from = close + 2;
+    }
+}
+
+void HttpTemplate::render(HttpBodyWriter &out, std::initializer_list<Argument> arguments) const {
+    const char *data = source.constData();
+
+    for (const auto &part : parts) {
+        if (part.size)
+            out.write(data + part.from, part.size);
+
+        if (part.slot < 0)
+            continue;
+
+        Q_ASSERT(part.slot < int(arguments.size()));
+        if (part.slot < int(arguments.size()))
+            writeArgument(out, arguments.begin()[part.slot], part.raw);
+    }
+}
+
+void HttpTemplate::writeArgument(HttpBodyWriter &out, const Argument &argument, bool raw) {
+    switch (argument.kind) {
+        case Argument::Kind::Text:
+            if (raw)
+                out.write(argument.text, argument.size);
+            else
+                writeEscaped(out, argument.text, argument.size);
+            break;
+        case Argument::Kind::Number: {
+            char digits[21];
+            int length = 0;
+            quint64 value = argument.number;
+
+            do {
+                digits[sizeof(digits) - 1 - length++] = char('0' + value % 10);
+                value /= 10;
+            } while (value);
+
+            if (argument.negative)
+                digits[sizeof(digits) - 1 - length++] = '-';
+
+            out.write(digits + sizeof(digits) - length, length);
+            break;
+        }
+        case Argument::Kind::Content:
+            if (argument.content)
+                argument.content(out);
+            break;
+    }
+}
+
+void HttpTemplate::writeEscaped(HttpBodyWriter &out, const char *data, int size) {
+    // Runs that need no escaping are copied in one go.
+    int start = 0;
+
+    for (int i = 0; i < size; ++i) {
+        const char *reference;
+
+        switch (data[i]) {
+            case '&':  reference = "&amp;"; break;
+            case '<':  reference = "&lt;"; break;
+            case '>':  reference = "&gt;"; break;
+            case '"':  reference = "&quot;"; break;
+            case '\'': reference = "&#39;"; break;
+            default:
+                continue;
+        }
+
+        out.write(data + start, i - start);
+        out.write(reference, int(qstrlen(reference)));
+        start = i + 1;
+    }
+
+    out.write(data + start, size - start);
+}
+
+QT_END_NAMESPACE
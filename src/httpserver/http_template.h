@@ -0,0 +1,84 @@
+//
+// Created by kodor on 3/13/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_TEMPLATE_H
+#define QT_TCP_SERVER_HTTP_TEMPLATE_H
+
+#include "http_body_writer.h"
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qstring.h>
+#include <QtCore/qvector.h>
+
+#include <functional>
+#include <initializer_list>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * UTF-8 text split once into literal runs and slots: "{{name}}" is
+ * replaced by its argument escaped for HTML, "{{&name}}" by the argument
+ * as it is. Arguments are passed by position, in the order the names were
+ * given in, so rendering copies literals and arguments into the writer
+ * without looking anything up.
+ */
+class HttpTemplate {
+public:
+    class Argument {
+    public:
+        // Text is UTF-8 and has to outlive render().
+        Argument(const char *text);
+        Argument(const QByteArray &text);
+        Argument(const QString &text);
+        Argument(int number);
+        Argument(qint64 number);
+        Argument(quint64 number);
+        // Writes the slot's content itself, e.g. rendering rows one by one.
+        Argument(const std::function<void(HttpBodyWriter &out)> &content);
+
+    private:
+        friend class HttpTemplate;
+
+        enum class Kind {
+            Text,
+            Number,
+            Content
+        };
+
+        Kind kind;
+        const char *text { nullptr };
+        int size { 0 };
+        QByteArray converted;
+        quint64 number { 0 };
+        bool negative { false };
+        std::function<void(HttpBodyWriter &)> content;
+    };
+
+    HttpTemplate(const QByteArray &source, std::initializer_list<const char *> names);
+
+    void render(HttpBodyWriter &out, std::initializer_list<Argument> arguments) const;
+
+    // & < > " ' as character references.
+    static void writeEscaped(HttpBodyWriter &out, const char *data, int size);
+
+private:
+    struct Part {
+        // Literal run before the slot.
+        int from;
+        int size;
+        // -1 after the last slot.
+        int slot;
+        bool raw;
+    };
+
+    static void writeArgument(HttpBodyWriter &out, const Argument &argument, bool raw);
+
+    const QByteArray source;
+    QVector<Part> parts;
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_TEMPLATE_H
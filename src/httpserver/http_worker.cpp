@@ -0,0 +1,90 @@
+//
+// Created by kodor on 2/12/22.
+//
+
+#include "http_worker.h"
+#include "http_server.h"
+
+#include <QtCore/qloggingcategory.h>
+#include <QtCore/qmetaobject.h>
+#include <QtNetwork/qtcpsocket.h>
+
+QT_BEGIN_NAMESPACE
+
+Q_LOGGING_CATEGORY(lcWorker, "httpserver.worker")
+
+HttpWorker::HttpWorker(HttpServer *server)
+: server(server) {}
+
+HttpWorker::~HttpWorker() {}
+
+int HttpWorker::connectionCount() const {
+    return connections.load();
+}
+
+void HttpWorker::assign(qintptr socketDescriptor) {
+    connections.ref();
+    QMetaObject::invokeMethod(this, "handleDescriptor", Qt::QueuedConnection,
+                              Q_ARG(qintptr, socketDescriptor));
+}
+
+void HttpWorker::adopt(qintptr socketDescriptor) {
+    connections.ref();
+    handleDescriptor(socketDescriptor);
+}
+
+void HttpWorker::handleDescriptor(qintptr socketDescriptor) {
+    auto socket = new QTcpSocket(this);
+
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        qCWarning(lcWorker, "failed to adopt socket %lld (%s)",
+                  qlonglong(socketDescriptor), qPrintable(socket->errorString()));
+        connections.deref();
+        delete socket;
+        return;
+    }
+
+    QObject::connect(socket, &QObject::destroyed, this, [this] () {
+        connections.deref();
+    });
+
+    server->handleConnection(socket);
+}
+
+bool HttpWorker::listenOn(qintptr socketDescriptor) {
+    auto tcpServer = new HttpTcpServer(server, this, this);
+
+    if (!tcpServer->setSocketDescriptor(socketDescriptor)) {
+        qCCritical(lcWorker, "failed to listen on socket %lld (%s)",
+                   qlonglong(socketDescriptor), qPrintable(tcpServer->errorString()));
+        delete tcpServer;
+        return false;
+    }
+
+    _listeners.append(tcpServer);
+    return true;
+}
+
+void HttpWorker::closeLastListener() {
+    if (!_listeners.isEmpty())
+        delete _listeners.takeLast();
+}
+
+QVector<QTcpServer *> HttpWorker::listeners() const {
+    return _listeners;
+}
+
+HttpTcpServer::HttpTcpServer(HttpServer *httpServer, QObject *parent)
+: HttpTcpServer(httpServer, nullptr, parent) {}
+
+HttpTcpServer::HttpTcpServer(HttpServer *httpServer, HttpWorker *worker, QObject *parent)
+: QTcpServer(parent), httpServer(httpServer), worker(worker) {}
+
+void HttpTcpServer::incomingConnection(qintptr socketDescriptor) {
+    if (worker)
+        worker->adopt(socketDescriptor);
+    else if (!httpServer->dispatchConnection(socketDescriptor))
+        QTcpServer::incomingConnection(socketDescriptor);
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,78 @@
+//
+// Created by kodor on 2/12/22.
+//
+
+#ifndef QT_TCP_SERVER_HTTP_WORKER_H
+#define QT_TCP_SERVER_HTTP_WORKER_H
+
+#include <QtCore/qatomic.h>
+#include <QtCore/qobject.h>
+#include <QtCore/qvector.h>
+#include <QtNetwork/qtcpserver.h>
+
+QT_BEGIN_NAMESPACE
+
+class HttpServer;
+
+/*
+ * Lives in its own QThread and owns every socket handed to it, so that
+ * parsing, routing and writing of a connection all happen on that thread's
+ * event loop.
+ */
+class HttpWorker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit HttpWorker(HttpServer *server);
+    ~HttpWorker();
+
+    int connectionCount() const;
+
+    // Thread-safe: accounts the connection to this worker right away and
+    // adopts the descriptor on the worker thread.
+    void assign(qintptr socketDescriptor);
+
+    // Same as assign(), for descriptors accepted on the worker thread itself.
+    void adopt(qintptr socketDescriptor);
+
+    Q_INVOKABLE void handleDescriptor(qintptr socketDescriptor);
+
+    // Takes over an already listening socket (see HttpServer::setReusePort).
+    // Every listen() adds one, so a worker may accept on several.
+    Q_INVOKABLE bool listenOn(qintptr socketDescriptor);
+    // Undoes the latest successful listenOn().
+    Q_INVOKABLE void closeLastListener();
+
+    // Set by listenOn(); read it only once that call has returned.
+    QVector<QTcpServer *> listeners() const;
+
+private:
+    HttpServer *const server;
+    QAtomicInt connections { 0 };
+    QVector<QTcpServer *> _listeners;
+
+};
+
+/*
+ * Hands accepted descriptors over to HttpServer's workers instead of
+ * creating the QTcpSocket in the listening thread. A server owned by a
+ * worker keeps its connections on that worker.
+ */
+class HttpTcpServer : public QTcpServer {
+
+public:
+    explicit HttpTcpServer(HttpServer *httpServer, QObject *parent = nullptr);
+    HttpTcpServer(HttpServer *httpServer, HttpWorker *worker, QObject *parent = nullptr);
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    HttpServer *const httpServer;
+    HttpWorker *const worker;
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_HTTP_WORKER_H
@@ -3,75 +3,247 @@
 //
 
 #include <QtCore>
+#include <httpserver/http_json_writer.h>
 #include <httpserver/http_server.h>
+#include <httpserver/http_template.h>
+#include <storage/durable_store.h>
+#include <storage/sharded_hash_store.h>
 
+#include <cmath>
+#include <limits>
 
 
+
+// Items per GET /api page, unless ?limit= asks for another number up to
+// maxPageSize. A Link header points to the next page.
+static const int defaultPageSize = 1000;
+static const int maxPageSize = 10000;
+
+// /test renders the whole store, reading it this many items at a time.
+static const int testScanBatch = 1000;
+
+static const HttpTemplate testPage(
+        "<html>\n<body>\n<table>\n{{&rows}}</table>\n<br/>\n"
+        "<p>Log at LSN {{lsn}}, durable up to {{durable}}</p>\n</body>\n</html>\n",
+        { "rows", "lsn", "durable" });
+static const HttpTemplate testRow("<tr><td>{{id}}</td> <td>{{value}}</td></tr>\n",
+                                  { "id", "value" });
+
+// The largest id a JSON number holds exactly; /api/<id> takes no more
+// either, so every item can be read and written through both.
+static const KeyValueStore::Key maxId = Q_UINT64_C(1) << 53;
+static const char invalidIdMessage[] = "id has to be a whole number from 0 to 2^53";
+
+// Ids are JSON numbers. Only whole ones that a double holds exactly are
+// keys; anything else would convert to some other key or not at all.
+static bool keyFromJson(const QJsonValue &value, KeyValueStore::Key *key) {
+    if (!value.isDouble())
+        return false;
+
+    const double id = value.toDouble();
+    if (!(id >= 0 && id <= double(maxId)) || std::floor(id) != id)
+        return false;
+
+    *key = KeyValueStore::Key(id);
+    return true;
+}
+
+// Answers a write the store refused because it can't take changes any
+// more, rather than as a key conflict.
+static bool refusedWrite(const KeyValueStore &store, HttpResponder &responder) {
+    if (store.isWritable())
+        return false;
+
+    responder.write("The store can't take changes right now", {{  }},
+                    HttpResponder::StatusCode::ServiceUnavailable);
+    return true;
+}
+
+// A JSON array body on /api is a batch of {"op", "id", "value"} objects,
+// "op" being "insert", "put" or "delete" and defaulting to what the
+// request method does for a single object. All of them are applied, or
+// none if one conflicts.
+static void applyBatch(KeyValueStore &store, const QJsonArray &operations,
+                       HttpRequest::Method method, HttpResponder &&responder) {
+    QVector<KeyValueStore::Change> changes;
+    changes.reserve(operations.size());
+
+    for (int i = 0; i < operations.size(); ++i) {
+        const auto operation = operations.at(i).toObject();
+        const auto op = operation.value("op").toString();
+
+        KeyValueStore::Change change;
+
+        if (op == "insert" || (op.isEmpty() && method == HttpRequest::Method::POST))
+            change.kind = KeyValueStore::Change::Kind::Insert;
+        else if (op == "put" || (op.isEmpty() && method == HttpRequest::Method::PUT))
+            change.kind = KeyValueStore::Change::Kind::Put;
+        else if (op == "delete" || (op.isEmpty() && method == HttpRequest::Method::DELETE))
+            change.kind = KeyValueStore::Change::Kind::Remove;
+        else {
+            responder.write(QString("Operation %1 has no valid op").arg(i).toLocal8Bit(), {{  }},
+                            HttpResponder::StatusCode::BadRequest);
+            return;
+        }
+
+        const bool needsValue = change.kind != KeyValueStore::Change::Kind::Remove;
+
+        if (!operation.contains("id") || (needsValue && !operation.contains("value"))) {
+            responder.write(QString("Operation %1 has no value or id").arg(i).toLocal8Bit(), {{  }},
+                            HttpResponder::StatusCode::BadRequest);
+            return;
+        }
+
+        if (!keyFromJson(operation.value("id"), &change.key)) {
+            responder.write(QString("Operation %1: %2").arg(i).arg(invalidIdMessage).toLocal8Bit(),
+                            {{  }}, HttpResponder::StatusCode::BadRequest);
+            return;
+        }
+
+        if (needsValue)
+            change.value = operation.value("value").toString().toLocal8Bit();
+
+        changes.append(change);
+    }
+
+    int failed;
+
+    if (!store.apply(changes, &failed)) {
+        if (refusedWrite(store, responder))
+            return;
+        responder.write(QString("Operation %1 conflicts on id %2, nothing was applied")
+                                .arg(failed).arg(changes.at(failed).key).toLocal8Bit(),
+                        {{  }},
+                        HttpResponder::StatusCode::Conflict);
+        return;
+    }
+
+    QJsonObject result;
+    result["applied"] = changes.size();
+
+    responder.write(QJsonDocument(result), HttpResponder::StatusCode::Ok);
+}
+
 int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
 
     HttpServer server;
+    server.setWorkerThreadCount(QThread::idealThreadCount());
+    server.setReusePort(true);
 
-    server.route("/api", [] (
-            QMap<quint8, QByteArray> &table,
-            QList<QString> &transactionLog,
+    auto durableStore = new DurableStore(new ShardedHashStore, QStringLiteral("data"));
+    durableStore->log().setGroupCommitWindow(2);
+    durableStore->log().setSegmentSize(64 * 1024 * 1024);
+
+    if (!durableStore->open()) {
+        qDebug() << "Failed to replay the write-ahead log.";
+        delete durableStore;
+        return 1;
+    }
+
+    server.setStore(durableStore);
+
+    server.route("/api", HttpRequest::Method::Get | HttpRequest::Method::Head |
+                         HttpRequest::Method::Post | HttpRequest::Method::Put |
+                         HttpRequest::Method::Delete,
+                 HttpServer::RouteOption::CacheResponse, [] (
+            KeyValueStore &store,
             const HttpRequest &request,
             HttpResponder &&responder) {
 
+        const bool reading = request.method() == HttpRequest::Method::GET
+                             || request.method() == HttpRequest::Method::HEAD;
+        const auto content = reading ? QJsonDocument() : QJsonDocument::fromJson(request.body());
+
+        if (content.isArray()) {
+            applyBatch(store, content.array(), request.method(), std::move(responder));
+            return;
+        }
+
         switch (request.method()) {
+            case HttpRequest::Method::HEAD:
             case HttpRequest::Method::GET: {
 
-                QJsonDocument ret;
-                QJsonArray data;
+                bool ok = true;
 
-                QMap<quint8, QByteArray>::const_iterator i = table.constBegin();
+                const QByteArray afterItem = request.query("after");
+                const bool hasAfter = !afterItem.isNull();
+                const auto after = hasAfter ? KeyValueStore::Key(afterItem.toULongLong(&ok)) : 0;
 
-                while (i != table.constEnd()) {
-                    QJsonObject obj;
-                    obj["id"] = i.key();
-                    obj["value"] = QString(i.value());
-                    data.append(obj);
-                    ++i;
+                int limit = defaultPageSize;
+                const QByteArray limitItem = request.query("limit");
+                if (ok && !limitItem.isNull()) {
+                    limit = limitItem.toInt(&ok);
+                    ok = ok && limit > 0;
                 }
 
-                ret.setArray(data);
+                if (!ok) {
+                    responder.write("after and limit have to be positive numbers", {{  }},
+                                    HttpResponder::StatusCode::BadRequest);
+                    return;
+                }
+
+                limit = qMin(limit, maxPageSize);
+
+                // One item more than asked for tells whether a next page exists.
+                auto items = !hasAfter
+                        ? store.scan(0, limit + 1)
+                        : after == std::numeric_limits<KeyValueStore::Key>::max()
+                        ? QVector<KeyValueStore::Item>()
+                        : store.scan(after + 1, limit + 1);
 
-                responder.write(ret,
-                                {{
-                                         HttpContentTypes::contentTypeHeader(),
-                                         HttpContentTypes::contentTypeJson()
-                                 }},
-                                HttpResponder::StatusCode::Ok);
+                HttpJsonWriter json(responder);
+
+                if (items.size() > limit) {
+                    items.removeLast();
+
+                    QByteArray link = "<";
+                    link.append(request.path());
+                    link.append("?after=");
+                    link.append(QByteArray::number(items.last().first));
+                    link.append("&limit=");
+                    link.append(QByteArray::number(limit));
+                    link.append(">; rel=\"next\"");
+                    json.addHeader("Link", link);
+                }
+
+                json.beginArray();
+                for (const auto &item : items) {
+                    json.beginObject();
+                    json.key("id");
+                    json.value(item.first);
+                    json.key("value");
+                    json.value(item.second);
+                    json.endObject();
+                }
+                json.endArray();
 
                 break;
             }
             case HttpRequest::Method::POST: {
-                auto content = QJsonDocument::fromJson(request.body());
-
                 if (!content.object().contains("value") || !content.object().contains("id")) {
                     responder.write("No value or id provided!", {{  }},
-                                    HttpResponder::StatusCode::NoContent);
+                                    HttpResponder::StatusCode::BadRequest);
                     return;
                 }
 
-                auto key = content["id"].toInt();
+                KeyValueStore::Key key;
+                if (!keyFromJson(content["id"], &key)) {
+                    responder.write(invalidIdMessage, {{  }},
+                                    HttpResponder::StatusCode::BadRequest);
+                    return;
+                }
                 auto value = content["value"].toString().toLocal8Bit();
 
-
-                if (!table.contains(key)) {
-                    table[key] = value;
-                }
-                else {
+                if (!store.insert(key, value)) {
+                    if (refusedWrite(store, responder))
+                        return;
                     responder.write("An element with such already exists",
                                     {{}},
                                     HttpResponder::StatusCode::Forbidden);
+                    return;
                 }
 
-                transactionLog.push_back(
-                        QString("An element with id %1 has been added").
-                                arg(QString::number(key))
-                );
-
                 auto location = QString::number(key);
 
                 responder.write(location.toLocal8Bit(),
@@ -80,28 +252,30 @@ int main(int argc, char *argv[]) {
                 break;
             }
             case HttpRequest::Method::DELETE: {
-                auto content = QJsonDocument::fromJson(request.body());
-
                 if (!content.object().contains("id")) {
                     responder.write("No id provided!", {{  }},
-                                    HttpResponder::StatusCode::NoContent);
+                                    HttpResponder::StatusCode::BadRequest);
                     return;
                 }
 
-                auto key = content["id"].toInt();
+                KeyValueStore::Key key;
+                if (!keyFromJson(content["id"], &key)) {
+                    responder.write(invalidIdMessage, {{  }},
+                                    HttpResponder::StatusCode::BadRequest);
+                    return;
+                }
 
-                if (table.contains(key))
-                    table.remove(key);
-                else
+                if (!store.remove(key)) {
+                    if (refusedWrite(store, responder))
+                        return;
                     responder.write("No such element in table",
                                     {{  }},
-                                    HttpResponder::StatusCode::Created);
-
+                                    HttpResponder::StatusCode::NotFound);
+                    return;
+                }
 
                 auto msg = QString("An item with id(%1) deleted").arg(key);
 
-                transactionLog.push_back(msg);
-
                 responder.write(msg.toLocal8Bit(),
                                 {{  }},
                                 HttpResponder::StatusCode::Created);
@@ -110,29 +284,30 @@ int main(int argc, char *argv[]) {
                 break;
             }
             case HttpRequest::Method::PUT: {
-                auto content = QJsonDocument::fromJson(request.body());
-
                 if (!content.object().contains("value") || !content.object().contains("id")) {
                     responder.write("No value provided!", {{  }},
-                                    HttpResponder::StatusCode::NoContent);
+                                    HttpResponder::StatusCode::BadRequest);
                     return;
                 }
 
-                auto key = content["id"].toInt();
+                KeyValueStore::Key key;
+                if (!keyFromJson(content["id"], &key)) {
+                    responder.write(invalidIdMessage, {{  }},
+                                    HttpResponder::StatusCode::BadRequest);
+                    return;
+                }
                 auto value = content["value"].toString().toLocal8Bit();
 
+                const bool added = store.put(key, value);
+                if (!added && refusedWrite(store, responder))
+                    return;
+
                 QString msg;
 
-                if (!table.contains(key)) {
-                    table[key] = value;
+                if (added)
                     msg = QString("An element with id %1 has been added").arg(key);
-                    transactionLog.push_back(msg);
-                }
-                else {
-                    table[key] = value;
+                else
                     msg = QString("An element with id %1 has been modified").arg(key);
-                    transactionLog.push_back(msg);
-                }
 
                 auto location = QString::number(key);
 
@@ -146,42 +321,72 @@ int main(int argc, char *argv[]) {
         }
     });
 
-    server.route("/test", [] (
-            QMap<quint8, QByteArray> &table,
-            QList<QString> &transactionLog,
+    server.route("/api/<id>", HttpRequest::Method::Get | HttpRequest::Method::Head |
+            HttpRequest::Method::Delete, [] (
+            KeyValueStore::Key id,
+            KeyValueStore &store,
             const HttpRequest &request,
             HttpResponder &&responder) {
 
-        auto htmlMessage= QString("<html>\n<body>\n%1</body>\n</html>");
-        auto body = QString();
+        if (id > maxId) {
+            responder.write(HttpResponder::StatusCode::NotFound);
+            return;
+        }
 
-        auto htmlTableRow = QString("<tr>\n%1</tr><br/>");
-        auto htmlTableData = QString("<td>%1</td>");
+        if (request.method() == HttpRequest::Method::DELETE) {
+            if (!store.remove(id)) {
+                if (refusedWrite(store, responder))
+                    return;
+                responder.write("No such element in table", {{  }},
+                                HttpResponder::StatusCode::NotFound);
+                return;
+            }
 
-        QMap<quint8, QByteArray>::const_iterator i = table.constBegin();
+            responder.write(QString("An item with id(%1) deleted").arg(id).toLocal8Bit(), {{  }},
+                            HttpResponder::StatusCode::Ok);
+            return;
+        }
 
-        while (i != table.constEnd()) {
-            auto td1 = htmlTableData.arg(i.key());
-            auto td2 = htmlTableData.arg(QString(i.value()));
-            td1.append(" ");
-            td1.append(td2);
-            auto row = htmlTableRow.arg(td1);
-            body.append(row);
-            ++i;
+        QByteArray value;
+        if (!store.get(id, &value)) {
+            responder.write("No such element in table", {{  }},
+                            HttpResponder::StatusCode::NotFound);
+            return;
         }
 
-        body.append("<br/>");
+        HttpJsonWriter json(responder);
+        json.beginObject();
+        json.key("id");
+        json.value(id);
+        json.key("value");
+        json.value(value);
+        json.endObject();
+    });
 
-        for (auto &it : transactionLog) {
-            auto td = htmlTableData.arg(it);
-            auto row = htmlTableRow.arg(td);
-            body.append(row);
-        }
+    server.route("/test", [durableStore] (
+            KeyValueStore &store,
+            const HttpRequest &request,
+            HttpResponder &&responder) {
+
+        auto &log = durableStore->log();
+        HttpBodyWriter html(responder, HttpContentTypes::contentTypeTextHTML());
 
-        std::initializer_list<std::pair<QByteArray, QByteArray>> headers =
-                {{ HttpContentTypes::contentTypeHeader(), HttpContentTypes::contentTypeTextHTML()}};
+        testPage.render(html, { HttpTemplate::Argument([&store] (HttpBodyWriter &out) {
+            // Each page is one point in time; writes between pages show up
+            // in the pages after them.
+            KeyValueStore::Key from = 0;
 
-        responder.write(htmlMessage.arg(body).toLocal8Bit(), headers,HttpResponder::StatusCode::Ok);
+            for (;;) {
+                const auto page = store.scan(from, testScanBatch);
+                for (const auto &item : page)
+                    testRow.render(out, { item.first, item.second });
+
+                if (page.size() < testScanBatch
+                        || page.last().first == std::numeric_limits<KeyValueStore::Key>::max())
+                    break;
+                from = page.last().first + 1;
+            }
+        }), log.lastLsn(), log.durableLsn() });
 
     });
 
@@ -0,0 +1,483 @@
+//
+// Created by kodor on 3/8/22.
+//
+
+#include "durable_store.h"
+
+#include <QtCore/qdir.h>
+#include <QtCore/qfileinfo.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qloggingcategory.h>
+#include <QtCore/qrunnable.h>
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <vector>
+
+QT_BEGIN_NAMESPACE
+
+Q_LOGGING_CATEGORY(lcDurableStore, "storage.durable")
+
+// Changes are kept with a tag in front of the value, so that a removal
+// can hide a key the snapshot still has.
+static const char putTag = '+';
+static const char removeTag = '-';
+
+class DurableStore::Checkpointer : public QRunnable {
+public:
+    explicit Checkpointer(DurableStore *store) : store(store) {}
+
+    void run() override {
+        store->checkpointQueued.store(0);
+        store->checkpoint();
+    }
+
+private:
+    DurableStore *const store;
+
+};
+
+// Walks the snapshot and the sorted changes in key order, leaving out
+// removed keys.
+static bool merge(const SnapshotFile *snapshot, const QVector<KeyValueStore::Item> &changes,
+                  const std::function<bool(KeyValueStore::Key, const QByteArray &)> &emit) {
+    const qint64 count = snapshot ? snapshot->count() : 0;
+    qint64 i = 0;
+    int j = 0;
+
+    while (i < count || j < changes.size()) {
+        if (j == changes.size() || (i < count && snapshot->keyAt(i) < changes.at(j).first)) {
+            if (!emit(snapshot->keyAt(i), snapshot->valueAt(i)))
+                return false;
+            ++i;
+            continue;
+        }
+
+        const auto &change = changes.at(j++);
+        if (i < count && snapshot->keyAt(i) == change.first)
+            ++i;
+
+        if (change.second.at(0) == putTag
+                && !emit(change.first, QByteArray::fromRawData(change.second.constData() + 1,
+                                                               change.second.size() - 1)))
+            return false;
+    }
+
+    return true;
+}
+
+DurableStore::DurableStore(KeyValueStore *store, const QString &directory)
+: changes(store), _log(directory) {
+    checkpointPool.setMaxThreadCount(1);
+}
+
+DurableStore::~DurableStore() {
+    checkpointPool.waitForDone();
+    _log.close();
+}
+
+QString DurableStore::snapshotPath(quint64 lsn) const {
+    return QDir(_log.directory()).filePath(QString("%1.snap").arg(lsn, 20, 10, QChar('0')));
+}
+
+QString DurableStore::latestSnapshot() const {
+    QDir dir(_log.directory());
+    const QStringList names = dir.entryList({ QStringLiteral("*.snap") }, QDir::Files, QDir::Name);
+    return names.isEmpty() ? QString() : dir.filePath(names.last());
+}
+
+bool DurableStore::open() {
+    const QString path = latestSnapshot();
+
+    if (!path.isEmpty()) {
+        auto snapshot = std::make_shared<SnapshotFile>();
+        if (!snapshot->open(path))
+            return false;
+        count.store(snapshot->count());
+        setBase(snapshot);
+    }
+
+    const auto snapshot = base();
+
+    return _log.open([this] (quint64, const WriteAheadLog::Mutation &mutation) {
+        if (mutation.operation == WriteAheadLog::Operation::Put)
+            applyPut(mutation.key, mutation.value);
+        else
+            applyRemove(mutation.key);
+    }, snapshot ? snapshot->lsn() : 0);
+}
+
+WriteAheadLog &DurableStore::log() {
+    return _log;
+}
+
+void DurableStore::setCheckpointInterval(qint64 interval) {
+    _checkpointInterval.store(qMax<qint64>(0, interval));
+}
+
+qint64 DurableStore::checkpointInterval() const {
+    return _checkpointInterval.load();
+}
+
+std::shared_ptr<const SnapshotFile> DurableStore::base() const {
+    QReadLocker locker(&baseLock);
+    return _base;
+}
+
+void DurableStore::setBase(const std::shared_ptr<const SnapshotFile> &snapshot) {
+    QWriteLocker locker(&baseLock);
+    _base = snapshot;
+}
+
+int DurableStore::stripeIndex(Key key) {
+    return int((key * Q_UINT64_C(0x9e3779b97f4a7c15)) >> 58);
+}
+
+QReadWriteLock &DurableStore::stripeFor(Key key) {
+    return stripes[stripeIndex(key)];
+}
+
+void DurableStore::lockAll(bool forWrite) const {
+    for (int i = 0; i < stripeCount; ++i) {
+        if (forWrite)
+            stripes[i].lockForWrite();
+        else
+            stripes[i].lockForRead();
+    }
+}
+
+void DurableStore::unlockAll() const {
+    for (int i = stripeCount; i > 0; --i)
+        stripes[i - 1].unlock();
+}
+
+bool DurableStore::lookup(Key key, QByteArray *value) const {
+    QByteArray change;
+    if (changes->get(key, &change)) {
+        if (change.at(0) == removeTag)
+            return false;
+        if (value)
+            *value = change.mid(1);
+        return true;
+    }
+
+    // A checkpoint swaps the snapshot before it drops the changes the new
+    // one holds, so whatever is missing here is in there.
+    const auto snapshot = base();
+    return snapshot && snapshot->find(key, value);
+}
+
+bool DurableStore::applyPut(Key key, const QByteArray &value) {
+    const bool added = !lookup(key, nullptr);
+
+    QByteArray change;
+    change.reserve(value.size() + 1);
+    change.append(putTag);
+    change.append(value);
+    changes->put(key, change);
+
+    if (added)
+        count.fetchAndAddRelaxed(1);
+    return added;
+}
+
+bool DurableStore::applyRemove(Key key) {
+    if (!lookup(key, nullptr))
+        return false;
+
+    // Kept even when the snapshot doesn't have the key: a checkpoint
+    // running meanwhile may write it into the next one.
+    changes->put(key, QByteArray(1, removeTag));
+    count.fetchAndAddRelaxed(-1);
+    return true;
+}
+
+void DurableStore::setFailed() {
+    if (_failed.testAndSetOrdered(0, 1))
+        qCCritical(lcDurableStore, "cannot write to %s, no more changes are taken",
+                   qPrintable(_log.directory()));
+}
+
+bool DurableStore::sync(quint64 lsn, int changeCount) {
+    // Changes queued when the log failed stay visible in memory, but none
+    // of them is acknowledged and no more are made.
+    if (!_log.waitDurable(lsn)) {
+        setFailed();
+        return false;
+    }
+
+    const qint64 interval = _checkpointInterval.load();
+    if (interval && changesSinceCheckpoint.fetchAndAddRelaxed(changeCount) + changeCount >= interval
+            && checkpointQueued.testAndSetOrdered(0, 1))
+        checkpointPool.start(new Checkpointer(this));
+    return true;
+}
+
+bool DurableStore::checkpoint() {
+    QMutexLocker locker(&checkpointMutex);
+
+    lockAll();
+    const auto previous = base();
+    const QVector<Item> captured = changes->snapshot();
+    const quint64 lsn = _log.lastLsn();
+    changesSinceCheckpoint.store(0);
+    unlockAll();
+
+    if (previous ? previous->lsn() == lsn : lsn == 0)
+        return true;
+
+    const QString path = snapshotPath(lsn);
+    SnapshotWriter writer(path, lsn);
+
+    const bool written = writer.open()
+            && merge(previous.get(), captured, [&writer] (Key key, const QByteArray &value) {
+                return writer.append(key, value);
+            })
+            && writer.commit();
+
+    auto next = std::make_shared<SnapshotFile>();
+    if (!written || !next->open(path))
+        return false;
+
+    lockAll(true);
+    setBase(next);
+    // Unless they changed again meanwhile, the snapshot now has them.
+    for (const auto &change : captured) {
+        QByteArray current;
+        if (changes->get(change.first, &current) && current == change.second)
+            changes->remove(change.first);
+    }
+    unlockAll();
+
+    _log.removeSegmentsThrough(lsn);
+
+    QDir dir(_log.directory());
+    const QString name = QFileInfo(path).fileName();
+    for (const auto &old : dir.entryList({ QStringLiteral("*.snap") }, QDir::Files, QDir::Name)) {
+        if (old < name && !dir.remove(old))
+            qCWarning(lcDurableStore, "cannot remove %s", qPrintable(dir.filePath(old)));
+    }
+
+    qCDebug(lcDurableStore, "checkpoint at LSN %llu with %lld items", lsn, next->count());
+    return true;
+}
+
+bool DurableStore::get(Key key, QByteArray *value) const {
+    return lookup(key, value);
+}
+
+bool DurableStore::contains(Key key) const {
+    return lookup(key, nullptr);
+}
+
+bool DurableStore::isWritable() const {
+    return !_failed.load();
+}
+
+// Each mutator logs its change before making it, so that a log that has
+// already failed leaves memory untouched.
+bool DurableStore::insert(Key key, const QByteArray &value) {
+    quint64 lsn;
+    {
+        QWriteLocker locker(&stripeFor(key));
+        if (!isWritable() || lookup(key, nullptr))
+            return false;
+        lsn = _log.append({ WriteAheadLog::Operation::Put, key, value });
+        if (!lsn) {
+            setFailed();
+            return false;
+        }
+        applyPut(key, value);
+    }
+    return sync(lsn);
+}
+
+bool DurableStore::put(Key key, const QByteArray &value) {
+    bool added;
+    quint64 lsn;
+    {
+        QWriteLocker locker(&stripeFor(key));
+        if (!isWritable())
+            return false;
+        lsn = _log.append({ WriteAheadLog::Operation::Put, key, value });
+        if (!lsn) {
+            setFailed();
+            return false;
+        }
+        added = applyPut(key, value);
+    }
+    return sync(lsn) && added;
+}
+
+bool DurableStore::remove(Key key) {
+    quint64 lsn;
+    {
+        QWriteLocker locker(&stripeFor(key));
+        if (!isWritable() || !lookup(key, nullptr))
+            return false;
+        lsn = _log.append({ WriteAheadLog::Operation::Remove, key, QByteArray() });
+        if (!lsn) {
+            setFailed();
+            return false;
+        }
+        applyRemove(key);
+    }
+    return sync(lsn);
+}
+
+bool DurableStore::apply(const QVector<Change> &batch, int *failedAt) {
+    std::vector<int> involved;
+    involved.reserve(size_t(batch.size()));
+    for (const auto &change : batch)
+        involved.push_back(stripeIndex(change.key));
+
+    // Index order, the same as lockAll().
+    std::sort(involved.begin(), involved.end());
+    involved.erase(std::unique(involved.begin(), involved.end()), involved.end());
+
+    if (!isWritable())
+        return false;
+
+    for (int index : involved)
+        stripes[index].lockForWrite();
+
+    // Whether the batch left a key present, for its later changes.
+    QHash<Key, bool> present;
+    int failed = -1;
+
+    for (int i = 0; i < batch.size(); ++i) {
+        const Change &change = batch.at(i);
+        const auto it = present.constFind(change.key);
+        const bool exists = it != present.constEnd() ? it.value() : lookup(change.key, nullptr);
+
+        if ((change.kind == Change::Kind::Insert && exists)
+                || (change.kind == Change::Kind::Remove && !exists)) {
+            failed = i;
+            break;
+        }
+
+        present.insert(change.key, change.kind != Change::Kind::Remove);
+    }
+
+    quint64 lsn = 0;
+
+    if (failed < 0 && !batch.isEmpty()) {
+        QVector<WriteAheadLog::Mutation> mutations;
+        mutations.reserve(batch.size());
+
+        for (const auto &change : batch) {
+            if (change.kind == Change::Kind::Remove)
+                mutations.append({ WriteAheadLog::Operation::Remove, change.key, QByteArray() });
+            else
+                mutations.append({ WriteAheadLog::Operation::Put, change.key, change.value });
+        }
+
+        // One record, so that replay brings back all of it or nothing.
+        lsn = _log.append(mutations);
+
+        for (int i = 0; lsn && i < batch.size(); ++i) {
+            const Change &change = batch.at(i);
+            if (change.kind == Change::Kind::Remove)
+                applyRemove(change.key);
+            else
+                applyPut(change.key, change.value);
+        }
+    }
+
+    for (auto it = involved.rbegin(); it != involved.rend(); ++it)
+        stripes[*it].unlock();
+
+    if (failed >= 0) {
+        if (failedAt)
+            *failedAt = failed;
+        return false;
+    }
+
+    if (batch.isEmpty())
+        return true;
+    if (!lsn) {
+        setFailed();
+        return false;
+    }
+    return sync(lsn, batch.size());
+}
+
+qint64 DurableStore::size() const {
+    return count.load();
+}
+
+QVector<KeyValueStore::Item> DurableStore::snapshot() const {
+    lockAll();
+    const auto snapshot = base();
+    const QVector<Item> captured = changes->snapshot();
+    unlockAll();
+
+    QVector<Item> items;
+    items.reserve(int(qMin<qint64>(count.load(), std::numeric_limits<int>::max())));
+
+    merge(snapshot.get(), captured, [&items] (Key key, const QByteArray &value) {
+        // The raw changes go away with captured.
+        items.append(qMakePair(key, QByteArray(value.constData(), value.size())));
+        return true;
+    });
+
+    return items;
+}
+
+QVector<KeyValueStore::Item> DurableStore::scan(Key from, int limit) const {
+    QVector<Item> items;
+    if (limit <= 0)
+        return items;
+
+    // The stripes keep writers and a checkpoint's swap out for one page,
+    // so the snapshot and the change pages are read at one point in time.
+    lockAll();
+
+    const auto snapshot = base();
+    const qint64 count = snapshot ? snapshot->count() : 0;
+    qint64 i = snapshot ? snapshot->lowerBound(from) : 0;
+
+    // Removals hide snapshot items, so the changes are read a page at a
+    // time until enough items are left.
+    QVector<Item> page;
+    int j = 0;
+    Key next = from;
+    bool morePages = true;
+
+    items.reserve(limit);
+
+    while (items.size() < limit) {
+        if (j == page.size() && morePages) {
+            page = changes->scan(next, limit);
+            j = 0;
+            morePages = page.size() == limit
+                    && page.last().first != std::numeric_limits<Key>::max();
+            if (morePages)
+                next = page.last().first + 1;
+        }
+
+        const bool haveChange = j < page.size();
+        const bool haveItem = i < count;
+
+        if (!haveChange && !haveItem)
+            break;
+
+        if (!haveChange || (haveItem && snapshot->keyAt(i) < page.at(j).first)) {
+            items.append(qMakePair(snapshot->keyAt(i), snapshot->valueAt(i)));
+            ++i;
+            continue;
+        }
+
+        const auto &change = page.at(j++);
+        if (haveItem && snapshot->keyAt(i) == change.first)
+            ++i;
+        if (change.second.at(0) == putTag)
+            items.append(qMakePair(change.first, change.second.mid(1)));
+    }
+
+    unlockAll();
+    return items;
+}
+
+QT_END_NAMESPACE
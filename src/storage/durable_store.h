@@ -0,0 +1,111 @@
+//
+// Created by kodor on 3/8/22.
+//
+
+#ifndef QT_TCP_SERVER_DURABLE_STORE_H
+#define QT_TCP_SERVER_DURABLE_STORE_H
+
+#include "key_value_store.h"
+#include "snapshot_file.h"
+#include "write_ahead_log.h"
+
+#include <QtCore/qatomic.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qreadwritelock.h>
+#include <QtCore/qthreadpool.h>
+
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Logs every successful mutation to a WriteAheadLog and returns once the
+ * record is on disk. The data lives in a mapped SnapshotFile plus the
+ * changes made since, kept in the wrapped store; checkpoints fold those into
+ * a new snapshot and drop the log segments it covers. open() maps the
+ * newest snapshot and replays only the log after it, so startup doesn't
+ * grow with the data. Writes to the same key are applied and logged under
+ * one lock, so that replay ends in the state readers saw. Once the log
+ * fails, the store turns read-only.
+ */
+class DurableStore : public KeyValueStore {
+public:
+    // Takes ownership of store, which only ever holds the changes since the
+    // last snapshot.
+    DurableStore(KeyValueStore *store, const QString &directory);
+    ~DurableStore();
+
+    bool open();
+    WriteAheadLog &log();
+
+    // A checkpoint starts in the background after this many changes;
+    // 100000 by default, 0 leaves it to checkpoint().
+    void setCheckpointInterval(qint64 interval);
+    qint64 checkpointInterval() const;
+
+    // Writes a snapshot of everything logged so far. Writers are held up
+    // only while the changes are collected and again while they're dropped.
+    bool checkpoint();
+
+    bool get(Key key, QByteArray *value) const override;
+    bool contains(Key key) const override;
+
+    bool insert(Key key, const QByteArray &value) override;
+    bool put(Key key, const QByteArray &value) override;
+    bool remove(Key key) override;
+
+    bool apply(const QVector<Change> &changes, int *failedAt = nullptr) override;
+    bool isWritable() const override;
+
+    qint64 size() const override;
+
+    QVector<Item> snapshot() const override;
+    QVector<Item> scan(Key from, int limit) const override;
+
+private:
+    class Checkpointer;
+
+    static const int stripeCount = 64;
+
+    static int stripeIndex(Key key);
+    QReadWriteLock &stripeFor(Key key);
+    // Readers only keep writers out; a checkpoint dropping changes locks
+    // them for writing.
+    void lockAll(bool forWrite = false) const;
+    void unlockAll() const;
+
+    std::shared_ptr<const SnapshotFile> base() const;
+    void setBase(const std::shared_ptr<const SnapshotFile> &snapshot);
+    QString latestSnapshot() const;
+    QString snapshotPath(quint64 lsn) const;
+
+    // Writers call these with the key's stripe held.
+    bool lookup(Key key, QByteArray *value) const;
+    bool applyPut(Key key, const QByteArray &value);
+    bool applyRemove(Key key);
+
+    bool sync(quint64 lsn, int changeCount = 1);
+    void setFailed();
+
+    std::unique_ptr<KeyValueStore> changes;
+    WriteAheadLog _log;
+    mutable QReadWriteLock stripes[stripeCount];
+
+    mutable QReadWriteLock baseLock;
+    std::shared_ptr<const SnapshotFile> _base;
+    QAtomicInteger<qint64> count { 0 };
+    QAtomicInt _failed { 0 };
+
+    QMutex checkpointMutex;
+    QThreadPool checkpointPool;
+    QAtomicInteger<qint64> changesSinceCheckpoint { 0 };
+    QAtomicInteger<qint64> _checkpointInterval { 100000 };
+    QAtomicInt checkpointQueued { 0 };
+
+    Q_DISABLE_COPY(DurableStore)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_DURABLE_STORE_H
@@ -0,0 +1,73 @@
+//
+// Created by kodor on 3/6/22.
+//
+
+#ifndef QT_TCP_SERVER_KEY_VALUE_STORE_H
+#define QT_TCP_SERVER_KEY_VALUE_STORE_H
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qpair.h>
+#include <QtCore/qvector.h>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Storage behind the handlers. Implementations have to be safe to call
+ * from every worker thread at once.
+ */
+class KeyValueStore {
+public:
+    using Key = quint64;
+    using Item = QPair<Key, QByteArray>;
+
+    struct Change {
+        enum class Kind : quint8 {
+            Insert,
+            Put,
+            Remove
+        };
+
+        Kind kind;
+        Key key;
+        QByteArray value;
+    };
+
+    virtual ~KeyValueStore() {}
+
+    virtual bool get(Key key, QByteArray *value) const = 0;
+    virtual bool contains(Key key) const = 0;
+
+    // Adds key only if it isn't there yet.
+    virtual bool insert(Key key, const QByteArray &value) = 0;
+    // Adds or replaces; true if key was new.
+    virtual bool put(Key key, const QByteArray &value) = 0;
+    virtual bool remove(Key key) = 0;
+
+    // Applies every change in order, or none of them if an Insert finds its
+    // key or a Remove misses it, counting the batch's own earlier changes.
+    // That change's index goes to failedAt. A snapshot() taken meanwhile
+    // has all of the batch or none of it.
+    virtual bool apply(const QVector<Change> &changes, int *failedAt = nullptr) = 0;
+
+    // False for good once a change couldn't be kept, e.g. a write error.
+    // Every mutator then returns false, and apply() leaves failedAt alone;
+    // ask this after a call to tell that apart from a key conflict.
+    virtual bool isWritable() const { return true; }
+
+    virtual qint64 size() const = 0;
+
+    // Every item at one point in time, ordered by key. Values share their
+    // data with the store.
+    virtual QVector<Item> snapshot() const = 0;
+
+    // Up to limit items with a key of at least from, ordered by key, taken
+    // at one point in time like snapshot(): writers wait while a page is
+    // read. Memory is bounded by limit; pages taken one after another are
+    // each consistent, but not with each other.
+    virtual QVector<Item> scan(Key from, int limit) const = 0;
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_KEY_VALUE_STORE_H
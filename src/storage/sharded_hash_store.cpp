@@ -0,0 +1,338 @@
+//
+// Created by kodor on 3/6/22.
+//
+
+#include "sharded_hash_store.h"
+
+#include <QtCore/qhash.h>
+
+#include <algorithm>
+#include <vector>
+
+QT_BEGIN_NAMESPACE
+
+static const int minimumCapacity = 16;
+
+ShardedHashStore::ShardedHashStore(int shardCountLog2)
+: shardBits(qBound(0, shardCountLog2, 16)), shards(new Shard[size_t(1) << shardBits]) {}
+
+ShardedHashStore::~ShardedHashStore() {}
+
+quint64 ShardedHashStore::hash(Key key) {
+    // splitmix64 finaliser: sequential ids spread over shards and slots.
+    key ^= key >> 30;
+    key *= Q_UINT64_C(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= Q_UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return key;
+}
+
+size_t ShardedHashStore::shardIndex(quint64 hash) const {
+    // Top bits pick the shard, low bits the slot, so they don't correlate.
+    return shardBits ? size_t(hash >> (64 - shardBits)) : 0;
+}
+
+ShardedHashStore::Shard &ShardedHashStore::shardFor(quint64 hash) const {
+    return shards[shardIndex(hash)];
+}
+
+int ShardedHashStore::find(const Shard &shard, Key key, quint64 hash) {
+    const int capacity = shard.slots.size();
+    if (!capacity)
+        return -1;
+
+    const int mask = capacity - 1;
+    const Slot *slots = shard.slots.constData();
+
+    for (int i = int(hash & quint64(mask));; i = (i + 1) & mask) {
+        if (slots[i].state == SlotState::Empty)
+            return -1;
+        if (slots[i].state == SlotState::Full && slots[i].key == key)
+            return i;
+    }
+}
+
+ShardedHashStore::Slot &ShardedHashStore::slotForInsert(Shard &shard, Key key, quint64 hash) {
+    const int capacity = shard.slots.size();
+
+    if ((shard.used + shard.deleted + 1) * 4 > capacity * 3) {
+        // Grow when live entries fill half of it, otherwise just sweep out
+        // the deleted slots.
+        const int grown = shard.used * 2 >= capacity ? capacity * 2 : capacity;
+        rehash(shard, qMax(grown, minimumCapacity));
+    }
+
+    const int mask = shard.slots.size() - 1;
+    Slot *slots = shard.slots.data();
+
+    int i = int(hash & quint64(mask));
+    while (slots[i].state == SlotState::Full)
+        i = (i + 1) & mask;
+
+    if (slots[i].state == SlotState::Deleted)
+        --shard.deleted;
+    ++shard.used;
+
+    slots[i].key = key;
+    slots[i].state = SlotState::Full;
+    return slots[i];
+}
+
+void ShardedHashStore::rehash(Shard &shard, int capacity) {
+    QVector<Slot> old(capacity);
+    old.swap(shard.slots);
+    shard.used = 0;
+    shard.deleted = 0;
+
+    for (auto &slot : old) {
+        if (slot.state == SlotState::Full)
+            slotForInsert(shard, slot.key, hash(slot.key)).value = std::move(slot.value);
+    }
+}
+
+void ShardedHashStore::sortKeys(const Shard &shard) {
+    shard.order.clear();
+    shard.order.reserve(shard.used);
+
+    for (const auto &slot : shard.slots) {
+        if (slot.state == SlotState::Full)
+            shard.order.append(slot.key);
+    }
+
+    std::sort(shard.order.begin(), shard.order.end());
+    shard.orderStale = false;
+}
+
+bool ShardedHashStore::get(Key key, QByteArray *value) const {
+    const quint64 h = hash(key);
+    const Shard &shard = shardFor(h);
+    QReadLocker locker(&shard.lock);
+
+    const int index = find(shard, key, h);
+    if (index < 0)
+        return false;
+
+    if (value)
+        *value = shard.slots.at(index).value;
+    return true;
+}
+
+bool ShardedHashStore::contains(Key key) const {
+    return get(key, nullptr);
+}
+
+bool ShardedHashStore::insert(Key key, const QByteArray &value) {
+    const quint64 h = hash(key);
+    Shard &shard = shardFor(h);
+    QWriteLocker locker(&shard.lock);
+
+    if (find(shard, key, h) >= 0)
+        return false;
+
+    slotForInsert(shard, key, h).value = value;
+    shard.orderStale = true;
+    return true;
+}
+
+bool ShardedHashStore::put(Key key, const QByteArray &value) {
+    const quint64 h = hash(key);
+    Shard &shard = shardFor(h);
+    QWriteLocker locker(&shard.lock);
+    return putLocked(shard, key, h, value);
+}
+
+bool ShardedHashStore::remove(Key key) {
+    const quint64 h = hash(key);
+    Shard &shard = shardFor(h);
+    QWriteLocker locker(&shard.lock);
+    return removeLocked(shard, key, h);
+}
+
+bool ShardedHashStore::putLocked(Shard &shard, Key key, quint64 hash, const QByteArray &value) {
+    const int index = find(shard, key, hash);
+    if (index >= 0) {
+        shard.slots[index].value = value;
+        return false;
+    }
+
+    slotForInsert(shard, key, hash).value = value;
+    shard.orderStale = true;
+    return true;
+}
+
+bool ShardedHashStore::removeLocked(Shard &shard, Key key, quint64 hash) {
+    const int index = find(shard, key, hash);
+    if (index < 0)
+        return false;
+
+    Slot &slot = shard.slots[index];
+    slot.state = SlotState::Deleted;
+    slot.value = QByteArray();
+    shard.orderStale = true;
+    --shard.used;
+    ++shard.deleted;
+    return true;
+}
+
+bool ShardedHashStore::apply(const QVector<Change> &changes, int *failedAt) {
+    QVector<quint64> hashes;
+    hashes.reserve(changes.size());
+    std::vector<size_t> involved;
+    involved.reserve(size_t(changes.size()));
+
+    for (const auto &change : changes) {
+        hashes.append(hash(change.key));
+        involved.push_back(shardIndex(hashes.last()));
+    }
+
+    // Always locked in index order, like snapshot() does.
+    std::sort(involved.begin(), involved.end());
+    involved.erase(std::unique(involved.begin(), involved.end()), involved.end());
+
+    for (size_t index : involved)
+        shards[index].lock.lockForWrite();
+
+    // Whether the batch left a key present, for its later changes.
+    QHash<Key, bool> present;
+    int failed = -1;
+
+    for (int i = 0; i < changes.size(); ++i) {
+        const Change &change = changes.at(i);
+        const auto it = present.constFind(change.key);
+        const bool exists = it != present.constEnd()
+                ? it.value() : find(shardFor(hashes.at(i)), change.key, hashes.at(i)) >= 0;
+
+        if ((change.kind == Change::Kind::Insert && exists)
+                || (change.kind == Change::Kind::Remove && !exists)) {
+            failed = i;
+            break;
+        }
+
+        present.insert(change.key, change.kind != Change::Kind::Remove);
+    }
+
+    if (failed < 0) {
+        for (int i = 0; i < changes.size(); ++i) {
+            const Change &change = changes.at(i);
+            Shard &shard = shardFor(hashes.at(i));
+            if (change.kind == Change::Kind::Remove)
+                removeLocked(shard, change.key, hashes.at(i));
+            else
+                putLocked(shard, change.key, hashes.at(i), change.value);
+        }
+    }
+
+    for (auto it = involved.rbegin(); it != involved.rend(); ++it)
+        shards[*it].lock.unlock();
+
+    if (failed >= 0 && failedAt)
+        *failedAt = failed;
+    return failed < 0;
+}
+
+qint64 ShardedHashStore::size() const {
+    const size_t count = size_t(1) << shardBits;
+    qint64 total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        QReadLocker locker(&shards[i].lock);
+        total += shards[i].used;
+    }
+
+    return total;
+}
+
+QVector<KeyValueStore::Item> ShardedHashStore::snapshot() const {
+    const size_t count = size_t(1) << shardBits;
+
+    // All shards held at once, always in the same order, for a consistent
+    // view. Copying only bumps reference counts, so writers wait briefly.
+    for (size_t i = 0; i < count; ++i)
+        shards[i].lock.lockForRead();
+
+    int total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += shards[i].used;
+
+    QVector<Item> items;
+    items.reserve(total);
+
+    for (size_t i = 0; i < count; ++i) {
+        for (const auto &slot : shards[i].slots) {
+            if (slot.state == SlotState::Full)
+                items.append(qMakePair(slot.key, slot.value));
+        }
+    }
+
+    for (size_t i = count; i > 0; --i)
+        shards[i - 1].lock.unlock();
+
+    std::sort(items.begin(), items.end(), [] (const Item &lhs, const Item &rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    return items;
+}
+
+QVector<KeyValueStore::Item> ShardedHashStore::scan(Key from, int limit) const {
+    QVector<Item> items;
+    if (limit <= 0)
+        return items;
+
+    const size_t count = size_t(1) << shardBits;
+
+    // Each shard's ordered keys from the cursor on, merged through a
+    // min-heap: unless keys came or went since the last scan, a page costs
+    // its own size, not the store's.
+    struct Cursor {
+        const Key *next;
+        const Key *end;
+        const Shard *shard;
+    };
+    const auto byKey = [] (const Cursor &lhs, const Cursor &rhs) {
+        return *lhs.next > *rhs.next;
+    };
+    std::vector<Cursor> heap;
+    heap.reserve(count);
+
+    for (size_t i = 0; i < count; ++i)
+        shards[i].lock.lockForRead();
+
+    for (size_t i = 0; i < count; ++i) {
+        const Shard &shard = shards[i];
+        {
+            QMutexLocker locker(&shard.orderLock);
+            if (shard.orderStale)
+                sortKeys(shard);
+        }
+
+        const Key *end = shard.order.constData() + shard.order.size();
+        const Key *next = std::lower_bound(shard.order.constData(), end, from);
+        if (next != end)
+            heap.push_back(Cursor { next, end, &shard });
+    }
+    std::make_heap(heap.begin(), heap.end(), byKey);
+
+    while (!heap.empty() && items.size() < limit) {
+        std::pop_heap(heap.begin(), heap.end(), byKey);
+        Cursor &cursor = heap.back();
+
+        const Key key = *cursor.next;
+        const int index = find(*cursor.shard, key, hash(key));
+        Q_ASSERT(index >= 0);
+        items.append(qMakePair(key, cursor.shard->slots.at(index).value));
+
+        if (++cursor.next != cursor.end)
+            std::push_heap(heap.begin(), heap.end(), byKey);
+        else
+            heap.pop_back();
+    }
+
+    for (size_t i = count; i > 0; --i)
+        shards[i - 1].lock.unlock();
+
+    return items;
+}
+
+QT_END_NAMESPACE
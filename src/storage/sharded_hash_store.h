@@ -0,0 +1,90 @@
+//
+// Created by kodor on 3/6/22.
+//
+
+#ifndef QT_TCP_SERVER_SHARDED_HASH_STORE_H
+#define QT_TCP_SERVER_SHARDED_HASH_STORE_H
+
+#include "key_value_store.h"
+
+#include <QtCore/qmutex.h>
+#include <QtCore/qreadwritelock.h>
+
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Hash map split into shards by the top bits of the key's hash, each with
+ * its own read-write lock, so threads working on different keys rarely
+ * meet. A shard is an open-addressing table with linear probing, kept at
+ * most 3/4 full counting deleted slots. scan() merges the shards' keys in
+ * order from the cursor on. A shard sorts its keys only when a scan finds
+ * that keys came or went since the last one, so writes just mark it.
+ */
+class ShardedHashStore : public KeyValueStore {
+public:
+    explicit ShardedHashStore(int shardCountLog2 = 6);
+    ~ShardedHashStore();
+
+    bool get(Key key, QByteArray *value) const override;
+    bool contains(Key key) const override;
+
+    bool insert(Key key, const QByteArray &value) override;
+    bool put(Key key, const QByteArray &value) override;
+    bool remove(Key key) override;
+
+    bool apply(const QVector<Change> &changes, int *failedAt = nullptr) override;
+
+    qint64 size() const override;
+
+    QVector<Item> snapshot() const override;
+    QVector<Item> scan(Key from, int limit) const override;
+
+private:
+    enum class SlotState : quint8 {
+        Empty,
+        Full,
+        Deleted
+    };
+
+    struct Slot {
+        Key key = 0;
+        QByteArray value;
+        SlotState state = SlotState::Empty;
+    };
+
+    struct Shard {
+        mutable QReadWriteLock lock;
+        QVector<Slot> slots;
+        int used = 0;
+        int deleted = 0;
+
+        // Guards the order against scans sorting it at the same time; the
+        // shard's read lock is held too.
+        mutable QMutex orderLock;
+        mutable QVector<Key> order;
+        mutable bool orderStale = false;
+    };
+
+    static quint64 hash(Key key);
+
+    size_t shardIndex(quint64 hash) const;
+    Shard &shardFor(quint64 hash) const;
+    static int find(const Shard &shard, Key key, quint64 hash);
+    static Slot &slotForInsert(Shard &shard, Key key, quint64 hash);
+    static void rehash(Shard &shard, int capacity);
+    static void sortKeys(const Shard &shard);
+    static bool putLocked(Shard &shard, Key key, quint64 hash, const QByteArray &value);
+    static bool removeLocked(Shard &shard, Key key, quint64 hash);
+
+    const int shardBits;
+    std::unique_ptr<Shard[]> shards;
+
+    Q_DISABLE_COPY(ShardedHashStore)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_SHARDED_HASH_STORE_H
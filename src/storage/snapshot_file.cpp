@@ -0,0 +1,191 @@
+//
+// Created by kodor on 3/10/22.
+//
+
+#include "snapshot_file.h"
+
+#include <QtCore/qendian.h>
+#include <QtCore/qfileinfo.h>
+#include <QtCore/qloggingcategory.h>
+
+#include <cstring>
+
+#if defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+Q_LOGGING_CATEGORY(lcSnapshot, "storage.snapshot")
+
+static const char magic[8] = { 'Q', 'K', 'V', 'S', 'N', 'A', 'P', '1' };
+static const qint64 headerSize = 32;
+static const qint64 entrySize = 24;
+
+// The rename that commits a snapshot only survives a crash once its
+// directory entry does.
+static bool syncDirectory(const QString &path) {
+#if defined(Q_OS_UNIX)
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    const bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+#else
+    Q_UNUSED(path);
+    return true;
+#endif
+}
+
+SnapshotFile::SnapshotFile() {}
+
+SnapshotFile::~SnapshotFile() {}
+
+bool SnapshotFile::open(const QString &fileName) {
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCCritical(lcSnapshot, "cannot open %s (%s)", qPrintable(fileName), qPrintable(file.errorString()));
+        return false;
+    }
+
+    size = file.size();
+    data = size >= headerSize ? file.map(0, size) : nullptr;
+
+    if (!data || memcmp(data, magic, sizeof(magic)) != 0) {
+        qCCritical(lcSnapshot, "%s is not a snapshot", qPrintable(fileName));
+        file.close();
+        data = nullptr;
+        return false;
+    }
+
+    _lsn = qFromLittleEndian<quint64>(data + 8);
+    const quint64 count = qFromLittleEndian<quint64>(data + 16);
+    const quint64 offset = qFromLittleEndian<quint64>(data + 24);
+
+    // Only the layout is checked; reading every entry would make opening
+    // as slow as loading.
+    if (offset < quint64(headerSize) || offset > quint64(size)
+            || count != (quint64(size) - offset) / entrySize
+            || (quint64(size) - offset) % entrySize) {
+        qCCritical(lcSnapshot, "%s is truncated", qPrintable(fileName));
+        file.close();
+        data = nullptr;
+        return false;
+    }
+
+    _count = qint64(count);
+    indexOffset = qint64(offset);
+    return true;
+}
+
+QString SnapshotFile::fileName() const {
+    return file.fileName();
+}
+
+quint64 SnapshotFile::lsn() const {
+    return _lsn;
+}
+
+qint64 SnapshotFile::count() const {
+    return _count;
+}
+
+const uchar *SnapshotFile::entry(qint64 index) const {
+    return data + indexOffset + index * entrySize;
+}
+
+SnapshotFile::Key SnapshotFile::keyAt(qint64 index) const {
+    return qFromLittleEndian<quint64>(entry(index));
+}
+
+QByteArray SnapshotFile::valueAt(qint64 index) const {
+    const uchar *e = entry(index);
+    const quint64 offset = qFromLittleEndian<quint64>(e + 8);
+    const quint32 length = qFromLittleEndian<quint32>(e + 16);
+
+    if (offset < quint64(headerSize) || offset + length > quint64(indexOffset)) {
+        qCWarning(lcSnapshot, "value %lld of %s is out of bounds", index, qPrintable(fileName()));
+        return QByteArray();
+    }
+
+    return QByteArray(reinterpret_cast<const char *>(data + offset), int(length));
+}
+
+qint64 SnapshotFile::lowerBound(Key key) const {
+    qint64 low = 0;
+    qint64 high = _count;
+
+    while (low < high) {
+        const qint64 middle = low + (high - low) / 2;
+        if (keyAt(middle) < key)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+bool SnapshotFile::find(Key key, QByteArray *value) const {
+    const qint64 index = lowerBound(key);
+
+    if (index == _count || keyAt(index) != key)
+        return false;
+
+    if (value)
+        *value = valueAt(index);
+    return true;
+}
+
+SnapshotWriter::SnapshotWriter(const QString &fileName, quint64 lsn)
+: file(fileName), lsn(lsn) {}
+
+bool SnapshotWriter::open() {
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCCritical(lcSnapshot, "cannot create %s (%s)", qPrintable(file.fileName()), qPrintable(file.errorString()));
+        return false;
+    }
+
+    // Filled in by commit(), once the index offset is known.
+    const QByteArray header(int(headerSize), '\0');
+    offset = headerSize;
+    return file.write(header) == headerSize;
+}
+
+bool SnapshotWriter::append(Key key, const QByteArray &value) {
+    char e[entrySize] = {};
+    qToLittleEndian<quint64>(key, e);
+    qToLittleEndian<quint64>(quint64(offset), e + 8);
+    qToLittleEndian<quint32>(quint32(value.size()), e + 16);
+    index.append(e, int(entrySize));
+
+    ++count;
+    offset += value.size();
+    return file.write(value) == value.size();
+}
+
+bool SnapshotWriter::commit() {
+    char header[headerSize];
+    memcpy(header, magic, sizeof(magic));
+    qToLittleEndian<quint64>(lsn, header + 8);
+    qToLittleEndian<quint64>(quint64(count), header + 16);
+    qToLittleEndian<quint64>(quint64(offset), header + 24);
+
+    if (file.write(index) != index.size() || !file.seek(0)
+            || file.write(header, headerSize) != headerSize || !file.commit()) {
+        qCCritical(lcSnapshot, "cannot write %s (%s)", qPrintable(file.fileName()), qPrintable(file.errorString()));
+        file.cancelWriting();
+        return false;
+    }
+
+    if (!syncDirectory(QFileInfo(file.fileName()).absolutePath())) {
+        qCCritical(lcSnapshot, "cannot sync the directory of %s", qPrintable(file.fileName()));
+        return false;
+    }
+
+    return true;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,89 @@
+//
+// Created by kodor on 3/10/22.
+//
+
+#ifndef QT_TCP_SERVER_SNAPSHOT_FILE_H
+#define QT_TCP_SERVER_SNAPSHOT_FILE_H
+
+#include "key_value_store.h"
+
+#include <QtCore/qfile.h>
+#include <QtCore/qsavefile.h>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Read-only view of a snapshot mapped into memory, so that opening one
+ * costs the same for any number of items. The file is
+ *
+ *   header: "QKVSNAP1" | u64 LSN | u64 item count | u64 index offset
+ *   values, back to back
+ *   index:  per item u64 key | u64 value offset | u32 value length | u32 0
+ *
+ * in little endian, the index sorted by key.
+ */
+class SnapshotFile {
+public:
+    using Key = KeyValueStore::Key;
+
+    SnapshotFile();
+    ~SnapshotFile();
+
+    bool open(const QString &fileName);
+    QString fileName() const;
+
+    // Every mutation up to this LSN is in the snapshot.
+    quint64 lsn() const;
+    qint64 count() const;
+
+    bool find(Key key, QByteArray *value) const;
+    // Index of the first item with a key of at least key, count() if none.
+    qint64 lowerBound(Key key) const;
+
+    Key keyAt(qint64 index) const;
+    QByteArray valueAt(qint64 index) const;
+
+private:
+    const uchar *entry(qint64 index) const;
+
+    QFile file;
+    const uchar *data { nullptr };
+    qint64 size { 0 };
+    quint64 _lsn { 0 };
+    qint64 _count { 0 };
+    qint64 indexOffset { 0 };
+
+    Q_DISABLE_COPY(SnapshotFile)
+
+};
+
+/*
+ * Writes a snapshot from items appended in ascending key order. Nothing
+ * replaces the file at its name before commit().
+ */
+class SnapshotWriter {
+public:
+    using Key = KeyValueStore::Key;
+
+    SnapshotWriter(const QString &fileName, quint64 lsn);
+
+    bool open();
+    bool append(Key key, const QByteArray &value);
+    // Renames the file into place and syncs its directory, so that the log
+    // it covers can go once this returns true.
+    bool commit();
+
+private:
+    QSaveFile file;
+    const quint64 lsn;
+    QByteArray index;
+    qint64 count { 0 };
+    qint64 offset { 0 };
+
+    Q_DISABLE_COPY(SnapshotWriter)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_SNAPSHOT_FILE_H
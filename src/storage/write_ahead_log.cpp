@@ -0,0 +1,453 @@
+//
+// Created by kodor on 3/8/22.
+//
+
+#include "write_ahead_log.h"
+
+#include <QtCore/qdir.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qendian.h>
+#include <QtCore/qloggingcategory.h>
+#include <QtCore/qthread.h>
+
+#include <array>
+
+#if defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+Q_LOGGING_CATEGORY(lcWal, "storage.wal")
+
+// Queued bytes that end the group commit window early.
+static const int groupCommitBytes = 1024 * 1024;
+static const int recordHeaderSize = 8;
+
+class WriteAheadLog::Flusher : public QThread {
+public:
+    explicit Flusher(WriteAheadLog *log) : log(log) {}
+
+protected:
+    void run() override {
+        log->flushLoop();
+    }
+
+private:
+    WriteAheadLog *const log;
+
+};
+
+static quint32 crc32(const uchar *data, qint64 size) {
+    static const std::array<quint32, 256> table = [] () {
+        std::array<quint32, 256> table;
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320u : 0);
+            table[i] = crc;
+        }
+        return table;
+    }();
+
+    quint32 crc = 0xffffffffu;
+    for (qint64 i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+template <typename T>
+static void appendLittleEndian(QByteArray &out, T value) {
+    char bytes[sizeof(T)];
+    qToLittleEndian(value, bytes);
+    out.append(bytes, int(sizeof(T)));
+}
+
+static bool decode(const uchar *payload, quint32 length, quint64 *lsn,
+                   QVector<WriteAheadLog::Mutation> *mutations) {
+    if (length < 12)
+        return false;
+
+    *lsn = qFromLittleEndian<quint64>(payload);
+    const quint32 count = qFromLittleEndian<quint32>(payload + 8);
+
+    const uchar *p = payload + 12;
+    const uchar *const end = payload + length;
+
+    mutations->clear();
+
+    for (quint32 i = 0; i < count; ++i) {
+        if (end - p < 9)
+            return false;
+
+        WriteAheadLog::Mutation mutation;
+        mutation.operation = WriteAheadLog::Operation(*p);
+        mutation.key = qFromLittleEndian<quint64>(p + 1);
+        p += 9;
+
+        if (mutation.operation == WriteAheadLog::Operation::Put) {
+            if (end - p < 4)
+                return false;
+            const quint32 size = qFromLittleEndian<quint32>(p);
+            p += 4;
+            if (quint32(end - p) < size)
+                return false;
+            mutation.value = QByteArray(reinterpret_cast<const char *>(p), int(size));
+            p += size;
+        } else if (mutation.operation != WriteAheadLog::Operation::Remove) {
+            return false;
+        }
+
+        mutations->append(mutation);
+    }
+
+    return p == end;
+}
+
+static bool syncFile(int fd) {
+#if defined(Q_OS_LINUX)
+    return ::fdatasync(fd) == 0;
+#elif defined(Q_OS_UNIX)
+    return ::fsync(fd) == 0;
+#else
+    Q_UNUSED(fd);
+    return true;
+#endif
+}
+
+// A new segment only survives a crash once its directory entry does.
+static void syncDirectory(const QString &path) {
+#if defined(Q_OS_UNIX)
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+    ::fsync(fd);
+    ::close(fd);
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+WriteAheadLog::WriteAheadLog(const QString &directory)
+: _directory(directory) {}
+
+WriteAheadLog::~WriteAheadLog() {
+    close();
+}
+
+QString WriteAheadLog::directory() const {
+    return _directory;
+}
+
+void WriteAheadLog::setGroupCommitWindow(int msecs) {
+    QMutexLocker locker(&mutex);
+    _groupCommitWindow = qMax(0, msecs);
+}
+
+int WriteAheadLog::groupCommitWindow() const {
+    QMutexLocker locker(&mutex);
+    return _groupCommitWindow;
+}
+
+void WriteAheadLog::setSegmentSize(qint64 bytes) {
+    QMutexLocker locker(&mutex);
+    _segmentSize = qMax<qint64>(recordHeaderSize, bytes);
+}
+
+qint64 WriteAheadLog::segmentSize() const {
+    QMutexLocker locker(&mutex);
+    return _segmentSize;
+}
+
+QString WriteAheadLog::segmentPath(quint64 firstLsn) const {
+    // Zero padded, so that name order is LSN order.
+    return QDir(_directory).filePath(QString("%1.wal").arg(firstLsn, 20, 10, QChar('0')));
+}
+
+QStringList WriteAheadLog::segmentNames() const {
+    return QDir(_directory).entryList({ QStringLiteral("*.wal") }, QDir::Files, QDir::Name);
+}
+
+quint64 WriteAheadLog::firstLsnOf(const QString &segmentName) {
+    return segmentName.section('.', 0, 0).toULongLong();
+}
+
+bool WriteAheadLog::open(const ReplayHandler &replay, quint64 after) {
+    if (isOpen())
+        return true;
+
+    QDir dir(_directory);
+    if (!dir.mkpath(".")) {
+        qCCritical(lcWal, "cannot create %s", qPrintable(_directory));
+        return false;
+    }
+
+    const QStringList names = segmentNames();
+    int replayed = 0;
+
+    for (int i = 0; i < names.size(); ++i) {
+        const bool last = i == names.size() - 1;
+        // Everything in it comes before the next segment's first record.
+        if (!last && firstLsnOf(names.at(i + 1)) <= after + 1)
+            continue;
+        if (!replaySegment(dir.filePath(names.at(i)), last, after, replay))
+            return false;
+        ++replayed;
+    }
+
+    nextLsn = qMax(nextLsn, after + 1);
+    _durableLsn = nextLsn - 1;
+
+    if (names.isEmpty()) {
+        if (!startSegment(nextLsn))
+            return false;
+    } else {
+        segment.setFileName(dir.filePath(names.last()));
+        if (!segment.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qCCritical(lcWal, "cannot open %s (%s)",
+                       qPrintable(segment.fileName()), qPrintable(segment.errorString()));
+            return false;
+        }
+    }
+
+    qCDebug(lcWal, "replayed %d segments up to LSN %llu", replayed, _durableLsn);
+
+    QMutexLocker locker(&mutex);
+    opened = true;
+    stopping = false;
+    failed = false;
+    flusher.reset(new Flusher(this));
+    flusher->start();
+    return true;
+}
+
+bool WriteAheadLog::replaySegment(const QString &fileName, bool last, quint64 after,
+                                  const ReplayHandler &replay) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadWrite)) {
+        qCCritical(lcWal, "cannot open %s (%s)", qPrintable(fileName), qPrintable(file.errorString()));
+        return false;
+    }
+
+    const qint64 size = file.size();
+    const uchar *data = size ? file.map(0, size) : nullptr;
+    if (size && !data) {
+        qCCritical(lcWal, "cannot map %s (%s)", qPrintable(fileName), qPrintable(file.errorString()));
+        return false;
+    }
+
+    QVector<Mutation> mutations;
+    qint64 offset = 0;
+
+    while (size - offset >= recordHeaderSize) {
+        const quint32 length = qFromLittleEndian<quint32>(data + offset);
+        const quint32 crc = qFromLittleEndian<quint32>(data + offset + 4);
+        const uchar *payload = data + offset + recordHeaderSize;
+
+        if (length > quint64(size - offset - recordHeaderSize) || crc32(payload, length) != crc)
+            break;
+
+        quint64 lsn;
+        if (!decode(payload, length, &lsn, &mutations) || lsn < nextLsn)
+            break;
+
+        if (lsn > after) {
+            for (const auto &mutation : mutations)
+                replay(lsn, mutation);
+        }
+
+        nextLsn = lsn + 1;
+        offset += recordHeaderSize + length;
+    }
+
+    if (offset == size)
+        return true;
+
+    if (!last) {
+        qCCritical(lcWal, "corrupt record at offset %lld of %s", offset, qPrintable(fileName));
+        return false;
+    }
+
+    // Whatever follows the last intact record was never acknowledged.
+    qCWarning(lcWal, "dropping %lld torn bytes at the end of %s", size - offset, qPrintable(fileName));
+    file.unmap(const_cast<uchar *>(data));
+    if (!file.resize(offset)) {
+        qCCritical(lcWal, "cannot truncate %s (%s)", qPrintable(fileName), qPrintable(file.errorString()));
+        return false;
+    }
+    return syncFile(file.handle());
+}
+
+void WriteAheadLog::close() {
+    {
+        QMutexLocker locker(&mutex);
+        if (!opened)
+            return;
+        stopping = true;
+        recordsQueued.wakeAll();
+    }
+
+    // The flusher drains the queue before it returns.
+    flusher->wait();
+    flusher.reset();
+    segment.close();
+
+    QMutexLocker locker(&mutex);
+    opened = false;
+    recordsDurable.wakeAll();
+}
+
+bool WriteAheadLog::isOpen() const {
+    QMutexLocker locker(&mutex);
+    return opened;
+}
+
+void WriteAheadLog::encode(QByteArray &out, quint64 lsn, const Mutation *mutations, int count) {
+    const int start = out.size();
+    out.resize(start + recordHeaderSize);
+
+    appendLittleEndian<quint64>(out, lsn);
+    appendLittleEndian<quint32>(out, quint32(count));
+
+    for (int i = 0; i < count; ++i) {
+        const Mutation &mutation = mutations[i];
+        out.append(char(mutation.operation));
+        appendLittleEndian<quint64>(out, mutation.key);
+        if (mutation.operation == Operation::Put) {
+            appendLittleEndian<quint32>(out, quint32(mutation.value.size()));
+            out.append(mutation.value);
+        }
+    }
+
+    const quint32 length = quint32(out.size() - start - recordHeaderSize);
+    const uchar *payload = reinterpret_cast<const uchar *>(out.constData()) + start + recordHeaderSize;
+    qToLittleEndian<quint32>(length, out.data() + start);
+    qToLittleEndian<quint32>(crc32(payload, length), out.data() + start + 4);
+}
+
+quint64 WriteAheadLog::append(const Mutation &mutation) {
+    return append(&mutation, 1);
+}
+
+quint64 WriteAheadLog::append(const QVector<Mutation> &mutations) {
+    return append(mutations.constData(), mutations.size());
+}
+
+quint64 WriteAheadLog::append(const Mutation *mutations, int count) {
+    QMutexLocker locker(&mutex);
+    if (!opened || stopping || failed)
+        return 0;
+
+    const quint64 lsn = nextLsn++;
+    const bool first = pending.isEmpty();
+    if (first)
+        pendingFirstLsn = lsn;
+
+    encode(pending, lsn, mutations, count);
+
+    if (first || pending.size() >= groupCommitBytes)
+        recordsQueued.wakeOne();
+    return lsn;
+}
+
+bool WriteAheadLog::waitDurable(quint64 lsn) {
+    if (!lsn)
+        return false;
+
+    QMutexLocker locker(&mutex);
+    while (_durableLsn < lsn && opened && !failed)
+        recordsDurable.wait(&mutex);
+    return _durableLsn >= lsn;
+}
+
+quint64 WriteAheadLog::lastLsn() const {
+    QMutexLocker locker(&mutex);
+    return nextLsn - 1;
+}
+
+quint64 WriteAheadLog::durableLsn() const {
+    QMutexLocker locker(&mutex);
+    return _durableLsn;
+}
+
+void WriteAheadLog::removeSegmentsThrough(quint64 lsn) {
+    const QStringList names = segmentNames();
+    QDir dir(_directory);
+
+    // The newest segment is the one being written, so it always stays.
+    for (int i = 0; i + 1 < names.size(); ++i) {
+        if (firstLsnOf(names.at(i + 1)) > lsn + 1)
+            break;
+        if (!dir.remove(names.at(i)))
+            qCWarning(lcWal, "cannot remove %s", qPrintable(dir.filePath(names.at(i))));
+    }
+}
+
+void WriteAheadLog::flushLoop() {
+    QMutexLocker locker(&mutex);
+
+    forever {
+        while (pending.isEmpty() && !stopping)
+            recordsQueued.wait(&mutex);
+        if (pending.isEmpty())
+            break;
+
+        // Let the writers that arrive meanwhile share this sync.
+        if (_groupCommitWindow > 0 && !stopping) {
+            QElapsedTimer timer;
+            timer.start();
+            qint64 remaining;
+            while (!stopping && pending.size() < groupCommitBytes
+                   && (remaining = _groupCommitWindow - timer.elapsed()) > 0)
+                recordsQueued.wait(&mutex, (unsigned long)remaining);
+        }
+
+        QByteArray batch;
+        batch.swap(pending);
+        const quint64 firstLsn = pendingFirstLsn;
+        const quint64 lastLsn = nextLsn - 1;
+        const qint64 rotateAt = _segmentSize;
+
+        locker.unlock();
+        const bool written = writeBatch(batch, firstLsn, rotateAt);
+        locker.relock();
+
+        if (written)
+            _durableLsn = lastLsn;
+        else
+            failed = true;
+        recordsDurable.wakeAll();
+
+        if (failed)
+            break;
+    }
+}
+
+bool WriteAheadLog::writeBatch(const QByteArray &batch, quint64 firstLsn, qint64 rotateAt) {
+    if (segment.size() >= rotateAt && !startSegment(firstLsn))
+        return false;
+
+    if (segment.write(batch) != batch.size() || !segment.flush() || !syncFile(segment.handle())) {
+        qCCritical(lcWal, "cannot write %s (%s)",
+                   qPrintable(segment.fileName()), qPrintable(segment.errorString()));
+        return false;
+    }
+    return true;
+}
+
+bool WriteAheadLog::startSegment(quint64 firstLsn) {
+    segment.close();
+    segment.setFileName(segmentPath(firstLsn));
+
+    if (!segment.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qCCritical(lcWal, "cannot create %s (%s)",
+                   qPrintable(segment.fileName()), qPrintable(segment.errorString()));
+        return false;
+    }
+
+    syncDirectory(_directory);
+    return true;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,129 @@
+//
+// Created by kodor on 3/8/22.
+//
+
+#ifndef QT_TCP_SERVER_WRITE_AHEAD_LOG_H
+#define QT_TCP_SERVER_WRITE_AHEAD_LOG_H
+
+#include "key_value_store.h"
+
+#include <QtCore/qfile.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qstring.h>
+#include <QtCore/qstringlist.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qwaitcondition.h>
+
+#include <functional>
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+
+/*
+ * Append-only binary log of store mutations, split into segment files named
+ * after the first sequence number (LSN) they hold. Each record is
+ *
+ *   u32 payload length | u32 CRC-32 of the payload | payload
+ *   payload: u64 LSN | u32 mutation count | mutations
+ *   mutation: u8 operation | u64 key | (Put only) u32 length | value
+ *
+ * in little endian. append() only queues a record; a flusher thread writes
+ * everything queued within the group commit window with one write and one
+ * fdatasync, so concurrent writers share the cost of a sync.
+ */
+class WriteAheadLog {
+public:
+    enum class Operation : quint8 {
+        Put = 1,
+        Remove = 2
+    };
+
+    struct Mutation {
+        Operation operation;
+        KeyValueStore::Key key;
+        QByteArray value;
+    };
+
+    using ReplayHandler = std::function<void(quint64 lsn, const Mutation &mutation)>;
+
+    explicit WriteAheadLog(const QString &directory);
+    ~WriteAheadLog();
+
+    QString directory() const;
+
+    // How long the flusher waits for more records before syncing; 2 ms by
+    // default, 0 syncs as soon as anything is queued.
+    void setGroupCommitWindow(int msecs);
+    int groupCommitWindow() const;
+
+    // A segment is closed and the next one started once it has grown past
+    // this many bytes; 64 MiB by default.
+    void setSegmentSize(qint64 bytes);
+    qint64 segmentSize() const;
+
+    // Hands every intact record after LSN `after` to replay in LSN order,
+    // cuts off a torn tail left by a crash and starts the flusher. Segments
+    // that hold nothing after it aren't read at all.
+    bool open(const ReplayHandler &replay, quint64 after = 0);
+    // Syncs what is queued and stops the flusher.
+    void close();
+    bool isOpen() const;
+
+    // Queues one record and returns its LSN, 0 if the log isn't open.
+    // Replay hands over all mutations of a record or, if it was torn, none.
+    quint64 append(const Mutation &mutation);
+    quint64 append(const QVector<Mutation> &mutations);
+    // Blocks until the record with this LSN is on disk; false if the log
+    // failed or was closed first.
+    bool waitDurable(quint64 lsn);
+
+    quint64 lastLsn() const;
+    quint64 durableLsn() const;
+
+    // Deletes the closed segments whose records all have an LSN up to lsn,
+    // once a snapshot covers them.
+    void removeSegmentsThrough(quint64 lsn);
+
+private:
+    class Flusher;
+
+    quint64 append(const Mutation *mutations, int count);
+    void flushLoop();
+    bool writeBatch(const QByteArray &batch, quint64 firstLsn, qint64 rotateAt);
+    bool startSegment(quint64 firstLsn);
+    bool replaySegment(const QString &fileName, bool last, quint64 after,
+                       const ReplayHandler &replay);
+    QString segmentPath(quint64 firstLsn) const;
+    QStringList segmentNames() const;
+
+    static quint64 firstLsnOf(const QString &segmentName);
+
+    static void encode(QByteArray &out, quint64 lsn, const Mutation *mutations, int count);
+
+    const QString _directory;
+    int _groupCommitWindow { 2 };
+    qint64 _segmentSize { 64 * 1024 * 1024 };
+
+    // Guards everything below except the segment file, which only the
+    // flusher touches once the log is open.
+    mutable QMutex mutex;
+    QWaitCondition recordsQueued;
+    QWaitCondition recordsDurable;
+    QByteArray pending;
+    quint64 pendingFirstLsn { 0 };
+    quint64 nextLsn { 1 };
+    quint64 _durableLsn { 0 };
+    bool opened { false };
+    bool stopping { false };
+    bool failed { false };
+
+    QFile segment;
+    std::unique_ptr<Flusher> flusher;
+
+    Q_DISABLE_COPY(WriteAheadLog)
+
+};
+
+QT_END_NAMESPACE
+
+#endif //QT_TCP_SERVER_WRITE_AHEAD_LOG_H